@@ -0,0 +1,90 @@
+//
+// Lock throughput benchmark
+//
+
+#include "lock_protocol.h"
+#include "lock_client.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+lock_client *lc;
+int seconds = 5;
+volatile bool stop;
+
+static double
+now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// acquires and releases locks of its own, so the threads never wait for
+// each other and the servers are the bottleneck
+void *
+worker(void *x)
+{
+  unsigned long long n = 0;
+  lock_protocol::lockid_t base = ((lock_protocol::lockid_t)(long) x + 1) << 32;
+  while (!stop) {
+    lock_protocol::lockid_t lid = base + (n % 1024);
+    lc->acquire(lid);
+    lc->release(lid);
+    n++;
+  }
+  return (void *) new unsigned long long(n);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nthreads = 16;
+  int ch;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  while((ch = getopt(argc, argv, "t:s:")) != -1){
+    switch(ch){
+      case 't':
+        nthreads = atoi(optarg);
+        break;
+      case 's':
+        seconds = atoi(optarg);
+        break;
+      default:
+        break;
+    }
+  }
+  if(argc - optind != 1 || nthreads < 1){
+    fprintf(stderr, "Usage: %s [-t threads] [-s seconds] [host:]port[,...]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  std::string dst = argv[optind];
+  lc = new lock_client(dst);
+  unsigned int nservers = 1;
+  for (unsigned i = 0; i < dst.size(); i++)
+    nservers += dst[i] == ',';
+
+  std::vector<pthread_t> th(nthreads);
+  double t0 = now_s();
+  for (int i = 0; i < nthreads; i++)
+    assert(pthread_create(&th[i], NULL, worker, (void *)(long) i) == 0);
+  sleep(seconds);
+  stop = true;
+  unsigned long long total = 0;
+  for (int i = 0; i < nthreads; i++) {
+    void *n;
+    pthread_join(th[i], &n);
+    total += *(unsigned long long *) n;
+    delete (unsigned long long *) n;
+  }
+  double t = now_s() - t0;
+  printf ("%u servers, %d threads: %llu acquire/release pairs in %.1fs, %.0f/s\n",
+          nservers, nthreads, total, t, total / t);
+}
@@ -2,45 +2,483 @@
 
 #include "lock_client.h"
 #include "rpc.h"
+#include "slock.h"
 #include <arpa/inet.h>
 
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <algorithm>
+#include <atomic>
+
+static std::atomic<unsigned int> last_owner(0);
+static thread_local unsigned int my_owner = 0;
+
+unsigned int
+lock_client::owner()
+{
+  if (my_owner == 0)
+    new_owner();
+  return my_owner;
+}
+
+void
+lock_client::new_owner()
+{
+  // the server keeps owners in 30 bits (see lock_record::held_by)
+  do
+    my_owner = ++last_owner & ((1u << 30) - 1);
+  while (my_owner == 0);
+}
 
 lock_client::lock_client(std::string dst)
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() < 0)
+  std::stringstream ss(dst);
+  std::string one;
+  while (std::getline(ss, one, ','))
   {
-    printf("lock_client: call bind\n");
+    sockaddr_in dstsock;
+    make_sockaddr(one.c_str(), &dstsock);
+    rpcc *cl = new rpcc(dstsock);
+    if (cl->bind() < 0)
+    {
+      printf("lock_client: call bind\n");
+    }
+    // the server answers these once the lock or units are free, which
+    // may be long after they arrive
+    cl->untimed(lock_protocol::acquire);
+    cl->untimed(lock_protocol::acquire_shared);
+    cl->untimed(lock_protocol::upgrade);
+    cl->untimed(lock_protocol::acquire_many);
+    cl->untimed(lock_protocol::try_acquire);
+    cl->untimed(lock_protocol::sem_acquire);
+    cls.push_back(cl);
   }
+  assert(!cls.empty());
+  ring = lock_ring(cls.size());
+  pthread_mutex_init(&local_m, NULL);
+}
+
+lock_client::~lock_client()
+{
+  for (unsigned i = 0; i < cls.size(); i++)
+    delete cls[i];
+  pthread_mutex_destroy(&local_m);
+}
+
+lock_client::local_lock::local_lock()
+    : server(NONE), held(false), next_ticket(0), serving(0), round_end(0),
+      token(0), token_used(false), owner(0), direct(0)
+{
+  pthread_cond_init(&c, NULL);
+}
+
+lock_client::local_lock::~local_lock()
+{
+  pthread_cond_destroy(&c);
 }
 
 int lock_client::stat(lock_protocol::lockid_t lid)
 {
+  rpcc *cl = server_of(lid);
   int r;
   int ret = cl->call(lock_protocol::stat, cl->id(), lid, r);
   assert(ret == lock_protocol::OK);
   return r;
 }
 
-lock_protocol::status
-lock_client::acquire(lock_protocol::lockid_t lid)
+int
+lock_client::server_acquire(lock_protocol::lockid_t lid, unsigned int &token)
 {
+  rpcc *cl = server_of(lid);
   int r;
-  int ret = cl->call(lock_protocol::acquire, cl->id(), lid, r);
+  int ret = cl->call(lock_protocol::acquire, cl->id(), lid, owner(), r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::DEADLOCK);
+  token = (unsigned int) r;
+  return ret;
+}
+
+int
+lock_client::server_release(lock_protocol::lockid_t lid, unsigned int owner)
+{
+  rpcc *cl = server_of(lid);
+  int r;
+  int ret = cl->call(lock_protocol::release, cl->id(), lid, owner, r);
   assert(ret == lock_protocol::OK);
   return r;
 }
 
+lock_protocol::status
+lock_client::acquire(lock_protocol::lockid_t lid, unsigned int *token)
+{
+  ScopedLock ml(&local_m);
+  local_lock &l = local_locks[lid];
+  unsigned long long ticket = l.next_ticket++;
+  while (ticket != l.serving)
+    pthread_cond_wait(&l.c, &local_m);
+  while (l.server != local_lock::GRANTED || ticket >= l.round_end ||
+         (token && l.token_used))
+  {
+    if (l.server == local_lock::GRANTED && ticket < l.round_end)
+    {
+      // the grant's token is taken: end its round here, and ask anew
+      l.round_end = ticket;
+      l.server = local_lock::RELEASING;
+      pthread_mutex_unlock(&local_m);
+      server_release(lid, l.owner);
+      pthread_mutex_lock(&local_m);
+      l.server = local_lock::NONE;
+    }
+    else if (l.server == local_lock::NONE)
+    {
+      l.server = local_lock::REQUESTING;
+      pthread_mutex_unlock(&local_m);
+      unsigned int t;
+      int ret = server_acquire(lid, t);
+      pthread_mutex_lock(&local_m);
+      if (ret != lock_protocol::OK)
+      {
+        // our turn ends without the lock; the next thread asks anew
+        l.server = local_lock::NONE;
+        l.serving++;
+        if (l.unused())
+          local_locks.erase(lid);
+        else
+          pthread_cond_broadcast(&l.c);
+        return ret;
+      }
+      l.server = local_lock::GRANTED;
+      l.token = t;
+      l.token_used = false;
+      l.owner = owner();
+      // everybody queued by now gets a turn before the lock goes back
+      l.round_end = l.next_ticket;
+    }
+    else
+      pthread_cond_wait(&l.c, &local_m);
+  }
+  l.held = true;
+  if (token)
+  {
+    *token = l.token;
+    l.token_used = true;
+  }
+  return lock_protocol::OK;
+}
+
+// notes a hold from try_acquire or acquire_shared (see local_lock::direct)
+void
+lock_client::add_direct(lock_protocol::lockid_t lid)
+{
+  ScopedLock ml(&local_m);
+  local_locks[lid].direct++;
+}
+
+// forgets one such hold, if there is one, and gives it back
+bool
+lock_client::release_direct(lock_protocol::lockid_t lid, int &r)
+{
+  if (!take_direct(lid))
+    return false;
+  r = server_release(lid, owner());
+  // with other holds of lid here, the server may have taken this for
+  // another thread's hold, and may still think we hold the lock
+  ScopedLock ml(&local_m);
+  if (local_locks.count(lid))
+    new_owner();
+  return true;
+}
+
+bool
+lock_client::take_direct(lock_protocol::lockid_t lid)
+{
+  ScopedLock ml(&local_m);
+  std::unordered_map<lock_protocol::lockid_t, local_lock>::iterator it =
+      local_locks.find(lid);
+  if (it == local_locks.end() || it->second.direct == 0)
+    return false;
+  it->second.direct--;
+  if (it->second.unused())
+    local_locks.erase(it);
+  return true;
+}
+
 lock_protocol::status
 lock_client::release(lock_protocol::lockid_t lid)
 {
   int r;
-  int ret = cl->call(lock_protocol::release, cl->id(), lid, r);
+  if (release_direct(lid, r))
+    return r;
+  ScopedLock ml(&local_m);
+  std::unordered_map<lock_protocol::lockid_t, local_lock>::iterator it =
+      local_locks.find(lid);
+  // a hold we do not track, such as one from acquire_async
+  if (it == local_locks.end() || !it->second.held)
+  {
+    pthread_mutex_unlock(&local_m);
+    r = server_release(lid, owner());
+    pthread_mutex_lock(&local_m);
+    return r;
+  }
+  local_lock &l = it->second;
+  assert(l.server == local_lock::GRANTED);
+  l.held = false;
+  l.serving++;
+  r = 0;
+  if (l.serving == l.round_end)
+  {
+    l.server = local_lock::RELEASING;
+    pthread_mutex_unlock(&local_m);
+    r = server_release(lid, l.owner);
+    pthread_mutex_lock(&local_m);
+    l.server = local_lock::NONE;
+  }
+  else if (l.owner == owner())
+    new_owner(); // the next thread holds our grant now
+  if (l.unused())
+    local_locks.erase(lid); // nobody left waiting on l.c
+  else
+    pthread_cond_broadcast(&l.c);
+  return r;
+}
+
+lock_protocol::status
+lock_client::acquire_shared(lock_protocol::lockid_t lid)
+{
+  rpcc *cl = server_of(lid);
+  int r;
+  int ret = cl->call(lock_protocol::acquire_shared, cl->id(), lid, owner(),
+                     r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::DEADLOCK);
+  if (ret == lock_protocol::OK)
+    add_direct(lid);
+  return ret;
+}
+
+// returns RETRY if another holder is already upgrading; the caller
+// still holds the lock shared and should release it before retrying
+lock_protocol::status
+lock_client::upgrade(lock_protocol::lockid_t lid)
+{
+  rpcc *cl = server_of(lid);
+  int r;
+  int ret = cl->call(lock_protocol::upgrade, cl->id(), lid, owner(), r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::RETRY ||
+         ret == lock_protocol::DEADLOCK);
+  return ret;
+}
+
+lock_protocol::status
+lock_client::downgrade(lock_protocol::lockid_t lid)
+{
+  rpcc *cl = server_of(lid);
+  int r;
+  int ret = cl->call(lock_protocol::downgrade, cl->id(), lid, r);
   assert(ret == lock_protocol::OK);
   return r;
 }
+
+// lids split up by the server that owns them, in shard order
+void
+lock_client::by_server(const std::vector<lock_protocol::lockid_t> &lids,
+                       std::map<unsigned int,
+                                std::vector<lock_protocol::lockid_t> > &m)
+{
+  for (unsigned i = 0; i < lids.size(); i++)
+    m[ring.shard_of(lids[i])].push_back(lids[i]);
+}
+
+// every server's share is taken in turn, in shard order. like the
+// sorted order within one server, this makes batches that overlap take
+// their locks in the same order, so they cannot deadlock.
+lock_protocol::status
+lock_client::acquire_many(const std::vector<lock_protocol::lockid_t> &lids)
+{
+  std::map<unsigned int, std::vector<lock_protocol::lockid_t> > m;
+  by_server(lids, m);
+  int r = lock_protocol::OK;
+  std::map<unsigned int, std::vector<lock_protocol::lockid_t> >::iterator it;
+  for (it = m.begin(); it != m.end(); it++)
+  {
+    rpcc *cl = cls[it->first];
+    int ret = cl->call(lock_protocol::acquire_many, cl->id(), it->second,
+                       owner(), r);
+    assert(ret == lock_protocol::OK || ret == lock_protocol::DEADLOCK);
+    if (ret == lock_protocol::DEADLOCK)
+    {
+      // the server gave back this share; give back the earlier ones
+      for (std::map<unsigned int, std::vector<lock_protocol::lockid_t> >::
+               iterator j = m.begin(); j != it; j++)
+      {
+        rpcc *held = cls[j->first];
+        assert(held->call(lock_protocol::release_many, held->id(), j->second,
+                          owner(), r) == lock_protocol::OK);
+      }
+      return ret;
+    }
+  }
+  return r;
+}
+
+lock_protocol::status
+lock_client::release_many(const std::vector<lock_protocol::lockid_t> &lids)
+{
+  std::map<unsigned int, std::vector<lock_protocol::lockid_t> > m;
+  by_server(lids, m);
+  int r = lock_protocol::OK;
+  std::map<unsigned int, std::vector<lock_protocol::lockid_t> >::iterator it;
+  for (it = m.begin(); it != m.end(); it++)
+  {
+    rpcc *cl = cls[it->first];
+    int ret = cl->call(lock_protocol::release_many, cl->id(), it->second,
+                       owner(), r);
+    assert(ret == lock_protocol::OK);
+  }
+  return r;
+}
+
+lock_protocol::status
+lock_client::sem_init(lock_protocol::lockid_t sid, unsigned int capacity)
+{
+  rpcc *cl = server_of(sid);
+  int r;
+  int ret = cl->call(lock_protocol::sem_init, cl->id(), sid, capacity, r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::RPCERR);
+  return ret;
+}
+
+lock_protocol::status
+lock_client::sem_acquire(lock_protocol::lockid_t sid, unsigned int n)
+{
+  rpcc *cl = server_of(sid);
+  int r;
+  int ret = cl->call(lock_protocol::sem_acquire, cl->id(), sid, n, r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::NOENT ||
+         ret == lock_protocol::RPCERR);
+  return ret;
+}
+
+lock_protocol::status
+lock_client::sem_release(lock_protocol::lockid_t sid, unsigned int n)
+{
+  rpcc *cl = server_of(sid);
+  int r;
+  int ret = cl->call(lock_protocol::sem_release, cl->id(), sid, n, r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::NOENT ||
+         ret == lock_protocol::RPCERR);
+  return ret;
+}
+
+// returns NOENT if the lease already ran out and the lock is lost
+lock_protocol::status
+lock_client::renew(lock_protocol::lockid_t lid)
+{
+  rpcc *cl = server_of(lid);
+  int r;
+  int ret = cl->call(lock_protocol::renew, cl->id(), lid, r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::NOENT);
+  return ret;
+}
+
+lock_protocol::status
+lock_client::try_acquire(lock_protocol::lockid_t lid, int timeout_ms)
+{
+  rpcc *cl = server_of(lid);
+  int r;
+  int ret = cl->call(lock_protocol::try_acquire, cl->id(), lid, timeout_ms,
+                     owner(), r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::RETRY ||
+         ret == lock_protocol::DEADLOCK);
+  if (ret == lock_protocol::OK)
+    add_direct(lid);
+  return ret;
+}
+
+lock_protocol::status
+lock_client::table_stat(std::map<std::string, unsigned long long> &r)
+{
+  r.clear();
+  for (unsigned i = 0; i < cls.size(); i++)
+  {
+    std::map<std::string, unsigned long long> one;
+    int ret = cls[i]->call(lock_protocol::table_stat, cls[i]->id(), one);
+    assert(ret == lock_protocol::OK);
+    std::map<std::string, unsigned long long>::iterator it;
+    for (it = one.begin(); it != one.end(); it++)
+      r[it->first] += it->second;
+  }
+  return lock_protocol::OK;
+}
+
+// NOENT if the server has no record of the lock (any more)
+lock_protocol::status
+lock_client::lock_stat(lock_protocol::lockid_t lid,
+                       lock_protocol::lock_stats &r)
+{
+  rpcc *cl = server_of(lid);
+  int ret = cl->call(lock_protocol::lock_stat, cl->id(), lid, r);
+  assert(ret == lock_protocol::OK || ret == lock_protocol::NOENT);
+  return ret;
+}
+
+static bool
+hotter(const lock_protocol::lock_stats &a, const lock_protocol::lock_stats &b)
+{
+  return a.hotter(b);
+}
+
+// the n hottest of every server's n hottest
+lock_protocol::status
+lock_client::top_locks(unsigned int n,
+                       std::vector<lock_protocol::lock_stats> &r)
+{
+  r.clear();
+  for (unsigned i = 0; i < cls.size(); i++)
+  {
+    std::vector<lock_protocol::lock_stats> one;
+    int ret = cls[i]->call(lock_protocol::top_locks, cls[i]->id(), n, one);
+    assert(ret == lock_protocol::OK);
+    r.insert(r.end(), one.begin(), one.end());
+  }
+  std::sort(r.begin(), r.end(), hotter);
+  if (r.size() > n)
+    r.resize(n);
+  return lock_protocol::OK;
+}
+
+void
+lock_client::acquire_async(lock_protocol::lockid_t lid, callback cb)
+{
+  rpcc *cl = server_of(lid);
+  // no thread waits for the reply, so none is named (see owner())
+  cl->call_async<int>(lock_protocol::acquire,
+                      [cb](int ret, int &) { cb(ret); }, rpcc::to_max,
+                      cl->id(), lid, 0u);
+}
+
+void
+lock_client::release_async(lock_protocol::lockid_t lid, callback cb)
+{
+  rpcc *cl = server_of(lid);
+  cl->call_async<int>(lock_protocol::release,
+                      [cb](int ret, int &) { cb(ret); }, rpcc::to_max,
+                      cl->id(), lid, 0u);
+}
+
+std::future<lock_protocol::status>
+lock_client::acquire_async(lock_protocol::lockid_t lid)
+{
+  std::shared_ptr<std::promise<lock_protocol::status> > p(
+      new std::promise<lock_protocol::status>());
+  acquire_async(lid, [p](lock_protocol::status ret) { p->set_value(ret); });
+  return p->get_future();
+}
+
+std::future<lock_protocol::status>
+lock_client::release_async(lock_protocol::lockid_t lid)
+{
+  std::shared_ptr<std::promise<lock_protocol::status> > p(
+      new std::promise<lock_protocol::status>());
+  release_async(lid, [p](lock_protocol::status ret) { p->set_value(ret); });
+  return p->get_future();
+}
@@ -5,19 +5,154 @@
 
 #include <string>
 #include "lock_protocol.h"
+#include "lock_ring.h"
 #include "rpc.h"
 #include <vector>
+#include <map>
+#include <functional>
+#include <future>
+#include <unordered_map>
 
 // Client interface to the lock server
 class lock_client {
  protected:
-  rpcc *cl;
+  // one per lock server, in shard order; ring picks a lock's server
+  std::vector<rpcc *> cls;
+  lock_ring ring;
+  rpcc *server_of(lock_protocol::lockid_t lid)
+  {
+    return cls[ring.shard_of(lid)];
+  }
+
+  // this client's threads queued for one lock, in ticket order. only the
+  // thread at the head has an acquire at the server; a grant is passed
+  // on to every thread that was queued when it came in, and goes back
+  // to the server after the last of them.
+  struct local_lock {
+    local_lock();
+    ~local_lock();
+    enum { NONE, REQUESTING, GRANTED, RELEASING } server;
+    bool held; // by one of our threads
+    unsigned long long next_ticket;
+    unsigned long long serving; // ticket of the next thread to get it
+    unsigned long long round_end; // first ticket the grant does not cover
+    unsigned int token; // the server's reply to the acquire
+    bool token_used; // handed out to one of our threads already
+    unsigned int owner; // of the thread that got the grant, see owner()
+    // holds from try_acquire and acquire_shared, which are the
+    // server's business only. release() gives one of these back before
+    // the queue's hold: the server cannot tell our holds apart, and
+    // this way a lock held both ways only ends the queue's round late,
+    // instead of passing it on while another thread still holds it.
+    unsigned int direct;
+    pthread_cond_t c;
+    bool unused() {
+      return serving == next_ticket && server == NONE && direct == 0;
+    }
+  };
+  pthread_mutex_t local_m;
+  std::unordered_map<lock_protocol::lockid_t, local_lock> local_locks;
+  void add_direct(lock_protocol::lockid_t);
+  bool take_direct(lock_protocol::lockid_t);
+  bool release_direct(lock_protocol::lockid_t, int &r);
+
+  void by_server(const std::vector<lock_protocol::lockid_t> &lids,
+                 std::map<unsigned int,
+                          std::vector<lock_protocol::lockid_t> > &m);
+  // the acquire and release RPCs themselves. acquire returns OK with
+  // the lock's token, or DEADLOCK. release names the thread the server
+  // knows the hold by.
+  int server_acquire(lock_protocol::lockid_t, unsigned int &token);
+  int server_release(lock_protocol::lockid_t, unsigned int owner);
+
+  // the id the server's deadlock detector knows the calling thread by;
+  // never 0, which the server takes for "no thread in particular". a
+  // thread that hands a server hold on to another thread of ours, or
+  // leaves one behind in a cache, takes a new id, so that it does not
+  // seem to hold the lock while it waits for others. a cycle through
+  // such a hold can then go unnoticed, but no thread is told DEADLOCK
+  // because of a lock it no longer has.
+  static unsigned int owner();
+  static void new_owner();
  public:
+  // gets the outcome of an asynchronous request: what the synchronous
+  // call would return, or an rpc_const failure (< 0) if no reply came
+  // in time
+  typedef std::function<void(lock_protocol::status)> callback;
+
+  // d is a lock server, or a comma-separated list of the servers of a
+  // cluster, shard 0 first (see lock_smain -s)
   lock_client(std::string d);
-  virtual ~lock_client() {};
-  virtual lock_protocol::status acquire(lock_protocol::lockid_t);
+  // closes the connection; no request may be outstanding. the server
+  // takes back locks still held once its grace period for us is over.
+  virtual ~lock_client();
+  // DEADLOCK if waiting would have closed a cycle of threads waiting for
+  // each other; the caller should release the locks it holds and retry.
+  // threads of one client that acquire the same lock share a single
+  // request at the server (see local_lock). the fencing token grows
+  // with every grant of the lock, so whatever the lock protects can
+  // turn away writes that carry an older one; a caller that asks for it
+  // gets one no other holder got, and if the shared grant's token went
+  // to an earlier thread, it gives the lock back and gets its own grant.
+  virtual lock_protocol::status acquire(lock_protocol::lockid_t,
+                                        unsigned int *token = NULL);
   virtual lock_protocol::status release(lock_protocol::lockid_t);
+  // the lock's current fencing token
   virtual lock_protocol::status stat(lock_protocol::lockid_t);
+  // shared holds are given back with release() too. with the lock held
+  // both ways, release() gives back a shared or try_acquire hold first
+  // (see local_lock::direct)
+  virtual lock_protocol::status acquire_shared(lock_protocol::lockid_t);
+  virtual lock_protocol::status upgrade(lock_protocol::lockid_t);
+  virtual lock_protocol::status downgrade(lock_protocol::lockid_t);
+  // all of lids, exclusively, in one round trip each way per server
+  virtual lock_protocol::status acquire_many(
+      const std::vector<lock_protocol::lockid_t> &);
+  virtual lock_protocol::status release_many(
+      const std::vector<lock_protocol::lockid_t> &);
+  // when the server hands out leases, holders must renew each lock
+  // within the lease period or lose it. lock_client_cache renews the
+  // locks it caches by itself.
+  virtual lock_protocol::status renew(lock_protocol::lockid_t);
+  // OK if the lock was acquired within timeout_ms, RETRY if not; the
+  // default timeout of 0 only takes the lock if it is free right now
+  virtual lock_protocol::status try_acquire(lock_protocol::lockid_t,
+                                            int timeout_ms = 0);
+  // counting semaphores, named by ids of their own (a semaphore and a
+  // lock with the same id are unrelated). sem_init creates one with
+  // room for capacity units, or changes its capacity. sem_acquire waits
+  // until n units are free and every earlier request has been served;
+  // it returns NOENT if there is no such semaphore and RPCERR if n is
+  // more than its capacity. sem_release returns RPCERR if the client
+  // holds fewer than n units. units are held by the client, not by a
+  // thread, and are not cached by lock_client_cache. a server with a
+  // log keeps semaphores and units across restarts, and a request sent
+  // again after one is not done twice. units are not leased, though:
+  // renew does not apply to them, and they are taken back only when the
+  // server drops the client after it has been gone for the grace period.
+  virtual lock_protocol::status sem_init(lock_protocol::lockid_t,
+                                         unsigned int capacity);
+  virtual lock_protocol::status sem_acquire(lock_protocol::lockid_t,
+                                            unsigned int n = 1);
+  virtual lock_protocol::status sem_release(lock_protocol::lockid_t,
+                                            unsigned int n = 1);
+  // start an acquire or release and return at once, so that one thread
+  // can have many requests outstanding. cb runs on the rpc completion
+  // thread, one completion at a time, so it should not block. these
+  // bypass lock_client_cache's cache.
+  void acquire_async(lock_protocol::lockid_t, callback cb);
+  void release_async(lock_protocol::lockid_t, callback cb);
+  std::future<lock_protocol::status> acquire_async(lock_protocol::lockid_t);
+  std::future<lock_protocol::status> release_async(lock_protocol::lockid_t);
+  // the servers' lock tables, added up: "records", "record_bytes",
+  // "reclaimed"
+  virtual lock_protocol::status table_stat(
+      std::map<std::string, unsigned long long> &);
+  // contention counters of one lock, or of the n most contended ones
+  virtual lock_protocol::status lock_stat(lock_protocol::lockid_t,
+                                          lock_protocol::lock_stats &);
+  virtual lock_protocol::status top_locks(
+      unsigned int n, std::vector<lock_protocol::lock_stats> &);
 };
 
 
@@ -0,0 +1,339 @@
+// RPC stubs for clients to talk to lock_server, and caching of the locks
+
+#include "lock_client_cache.h"
+#include "rpc.h"
+#include "slock.h"
+#include "method_thread.h"
+#include <sstream>
+#include <iostream>
+#include <stdio.h>
+#include <time.h>
+
+// how often a cache that no server gives leases to subscribes again
+static const int resubscribe_ms = 1000;
+
+static unsigned long long
+now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+lock_client_cache::cached_lock::cached_lock()
+    : state(NONE), token(0), token_used(false), owner(0), grants(0),
+      revoked(false), lost(false)
+{
+  pthread_cond_init(&c, NULL);
+}
+
+lock_client_cache::cached_lock::~cached_lock()
+{
+  pthread_cond_destroy(&c);
+}
+
+lock_client_cache::lock_client_cache(std::string xdst)
+  : lock_client(xdst), stopping(false)
+{
+  pthread_mutex_init(&m, NULL);
+  pthread_cond_init(&release_c, NULL);
+
+  rlsrpc = new rpcs(0);
+  rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache::revoke_handler);
+  rlsrpc->reg(rlock_protocol::notify, this, &lock_client_cache::notify_handler);
+  // the server is assumed to reach us on the loopback interface
+  std::ostringstream host;
+  host << "127.0.0.1:" << rlsrpc->port();
+  id = host.str();
+
+  // any of the servers may want a lock back
+  for (unsigned i = 0; i < cls.size(); i++)
+  {
+    int r;
+    int ret = cls[i]->call(lock_protocol::subscribe, cls[i]->id(), id, r);
+    assert(ret == lock_protocol::OK || ret == lock_protocol::NOENT);
+    lease_ms.push_back(r);
+  }
+
+  releaser_th = method_thread(this, false, &lock_client_cache::releaser);
+}
+
+lock_client_cache::~lock_client_cache()
+{
+  {
+    ScopedLock ml(&m);
+    stopping = true;
+    pthread_cond_signal(&release_c);
+  }
+  pthread_join(releaser_th, NULL);
+
+  // no revokes after this, so nothing else touches locks
+  delete rlsrpc;
+  {
+    ScopedLock ml(&m);
+    std::unordered_map<lock_protocol::lockid_t, cached_lock>::iterator it;
+    for (it = locks.begin(); it != locks.end(); it++)
+    {
+      assert(it->second.state == NONE || it->second.state == FREE);
+      if (it->second.state == FREE)
+        give_back(it->first, it->second);
+    }
+  }
+  pthread_mutex_destroy(&m);
+  pthread_cond_destroy(&release_c);
+}
+
+lock_protocol::status
+lock_client_cache::acquire(lock_protocol::lockid_t lid, unsigned int *token)
+{
+  ScopedLock ml(&m);
+  cached_lock &l = locks[lid];
+  while (true)
+  {
+    if (l.state == NONE)
+    {
+      l.state = ACQUIRING;
+      pthread_mutex_unlock(&m);
+      unsigned int t;
+      int ret = server_acquire(lid, t);
+      pthread_mutex_lock(&m);
+      if (ret != lock_protocol::OK)
+      {
+        l.state = NONE;
+        pthread_cond_broadcast(&l.c);
+        return ret;
+      }
+      l.state = LOCKED;
+      l.token = t;
+      l.token_used = token != NULL;
+      l.owner = owner();
+      l.grants++;
+      if (token)
+        *token = t;
+      return lock_protocol::OK;
+    }
+    if (l.state == FREE && !l.revoked && token && l.token_used)
+    {
+      // the token is taken; a grant of our own brings a new one
+      give_back(lid, l);
+      pthread_cond_broadcast(&l.c);
+      continue;
+    }
+    // a revoked lock goes back to the server first, so that the client
+    // waiting there gets its turn
+    if (l.state == FREE && !l.revoked)
+    {
+      l.state = LOCKED;
+      if (token)
+      {
+        *token = l.token;
+        l.token_used = true;
+      }
+      return lock_protocol::OK;
+    }
+    pthread_cond_wait(&l.c, &m);
+  }
+}
+
+lock_protocol::status
+lock_client_cache::release(lock_protocol::lockid_t lid)
+{
+  // a shared or timed hold is not cached
+  int r;
+  if (release_direct(lid, r))
+    return r;
+  ScopedLock ml(&m);
+  cached_lock &l = locks[lid];
+  assert(l.state == LOCKED);
+  if (l.lost)
+  {
+    // nothing to give back
+    l.state = NONE;
+    l.revoked = false;
+    l.lost = false;
+  }
+  else if (l.revoked)
+    give_back(lid, l);
+  else
+  {
+    l.state = FREE;
+    if (l.owner == owner())
+      new_owner(); // the server still counts the cached hold as ours
+  }
+  pthread_cond_broadcast(&l.c);
+  return lock_protocol::OK;
+}
+
+// releases l to the server. caller holds m.
+void
+lock_client_cache::give_back(lock_protocol::lockid_t lid, cached_lock &l)
+{
+  l.state = RELEASING;
+  pthread_mutex_unlock(&m);
+  rpcc *cl = server_of(lid);
+  int r;
+  int ret = cl->call(lock_protocol::release, cl->id(), lid, l.owner, r);
+  // RPCERR: the server took it back before keep_alive noticed
+  assert(ret == lock_protocol::OK || ret == lock_protocol::RPCERR);
+  pthread_mutex_lock(&m);
+  l.state = NONE;
+  l.revoked = false;
+}
+
+// the server has a waiter for lid. this only takes note: the release RPC
+// is sent by whoever finishes with the lock, or by the releaser thread,
+// never from inside the callback.
+rlock_protocol::status
+lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, int &r)
+{
+  ScopedLock ml(&m);
+  std::unordered_map<lock_protocol::lockid_t, cached_lock>::iterator it =
+      locks.find(lid);
+  // an old revoke for a hold we already gave back
+  if (it == locks.end() || it->second.state == NONE)
+    return rlock_protocol::OK;
+  it->second.revoked = true;
+  if (it->second.state == FREE)
+  {
+    to_release.push_back(lid);
+    pthread_cond_signal(&release_c);
+  }
+  return rlock_protocol::OK;
+}
+
+// how often keep_alive runs: a few times per the shortest lease
+int
+lock_client_cache::keep_alive_ms()
+{
+  int ms = resubscribe_ms;
+  for (unsigned i = 0; i < lease_ms.size(); i++)
+    if (lease_ms[i] > 0 && lease_ms[i] / 3 < ms)
+      ms = lease_ms[i] / 3;
+  return ms > 0 ? ms : 1;
+}
+
+// subscribes to every server again, and renews our cached locks on
+// those that hand out leases or had forgotten us. a lock that the
+// server says we do not hold is dropped from the cache, or, if a local
+// thread holds it, given up without a release when it is done. caller
+// holds m; it is dropped for the RPCs.
+void
+lock_client_cache::keep_alive()
+{
+  std::vector<bool> renew_on(cls.size(), false);
+  pthread_mutex_unlock(&m);
+  for (unsigned i = 0; i < cls.size(); i++)
+  {
+    int r;
+    int ret = cls[i]->call(lock_protocol::subscribe, cls[i]->id(), id, r);
+    assert(ret == lock_protocol::OK || ret == lock_protocol::NOENT);
+    lease_ms[i] = r;
+    renew_on[i] = ret == lock_protocol::NOENT || r > 0;
+  }
+  pthread_mutex_lock(&m);
+
+  // with the grant each was renewed for, so that a renew that crosses a
+  // give_back and a new grant does not drop the new one
+  std::vector<std::pair<lock_protocol::lockid_t, unsigned int> > renew;
+  std::unordered_map<lock_protocol::lockid_t, cached_lock>::iterator it;
+  for (it = locks.begin(); it != locks.end(); it++)
+  {
+    cached_lock &l = it->second;
+    if ((l.state == FREE || l.state == LOCKED) && !l.lost &&
+        renew_on[ring.shard_of(it->first)])
+      renew.push_back(std::make_pair(it->first, l.grants));
+  }
+  for (unsigned i = 0; i < renew.size() && !stopping; i++)
+  {
+    pthread_mutex_unlock(&m);
+    int ret = lock_client::renew(renew[i].first);
+    pthread_mutex_lock(&m);
+    cached_lock &l = locks[renew[i].first];
+    if (ret != lock_protocol::NOENT || l.grants != renew[i].second)
+      continue;
+    if (l.state == FREE)
+    {
+      l.state = NONE;
+      l.revoked = false;
+      pthread_cond_broadcast(&l.c);
+    }
+    else if (l.state == LOCKED)
+      l.lost = true;
+  }
+}
+
+void
+lock_client_cache::releaser()
+{
+  ScopedLock ml(&m);
+  unsigned long long next = now_ms() + keep_alive_ms();
+  while (!stopping)
+  {
+    while (to_release.empty() && !stopping && now_ms() < next)
+    {
+      struct timespec ts;
+      ts.tv_sec = next / 1000;
+      ts.tv_nsec = (next % 1000) * 1000000;
+      pthread_cond_timedwait(&release_c, &m, &ts);
+    }
+    if (stopping)
+      break;
+    if (to_release.empty())
+    {
+      keep_alive();
+      next = now_ms() + keep_alive_ms();
+      continue;
+    }
+    lock_protocol::lockid_t lid = to_release.back();
+    to_release.pop_back();
+    cached_lock &l = locks[lid];
+    if (l.state != FREE || !l.revoked)
+      continue;
+    give_back(lid, l);
+    pthread_cond_broadcast(&l.c);
+  }
+}
+
+lock_protocol::status
+lock_client_cache::watch(lock_protocol::lockid_t lid, watch_callback cb)
+{
+  {
+    ScopedLock ml(&m);
+    watchers[lid].push_back(cb);
+  }
+  rpcc *cl = server_of(lid);
+  int r;
+  int ret = cl->call(lock_protocol::watch, cl->id(), lid, r);
+  assert(ret == lock_protocol::OK);
+  if (r)
+    fire_watchers(lid, true);
+  return ret;
+}
+
+// runs and forgets the callbacks watching lid, outside m
+void
+lock_client_cache::fire_watchers(lock_protocol::lockid_t lid, bool free)
+{
+  std::vector<watch_callback> cbs;
+  {
+    ScopedLock ml(&m);
+    std::unordered_map<lock_protocol::lockid_t,
+                       std::vector<watch_callback> >::iterator it =
+        watchers.find(lid);
+    // already fired: a notify raced with watch finding the lock free
+    if (it == watchers.end())
+      return;
+    cbs.swap(it->second);
+    watchers.erase(it);
+  }
+  for (unsigned i = 0; i < cbs.size(); i++)
+    cbs[i](lid, free);
+}
+
+rlock_protocol::status
+lock_client_cache::notify_handler(lock_protocol::lockid_t lid, int free,
+                                  int &r)
+{
+  fire_watchers(lid, free != 0);
+  return rlock_protocol::OK;
+}
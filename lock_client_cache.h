@@ -0,0 +1,85 @@
+// lock client interface.
+
+#ifndef lock_client_cache_h
+#define lock_client_cache_h
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "lock_protocol.h"
+#include "rpc.h"
+#include "lock_client.h"
+
+// A lock client that keeps the locks it acquires. A lock released by one
+// of this process's threads stays here, so the next local acquire of it
+// is a mutex operation instead of an RPC. It only goes back to the
+// server when the server revokes it because some other client waits.
+// Shared, batched and timed acquires are not cached; they go to the
+// server as with lock_client.
+// The releaser thread keeps the cache in step with the servers: it
+// renews every cached lock, held locally or not, well within the lease
+// of a server that hands out leases, and it subscribes again from time
+// to time, which tells it whether a server dropped us after its grace
+// period. A cached lock a server no longer counts as ours is forgotten,
+// so the next acquire of it goes to the server.
+class lock_client_cache : public lock_client {
+ private:
+  enum lock_state { NONE, FREE, LOCKED, ACQUIRING, RELEASING };
+  struct cached_lock {
+    cached_lock();
+    ~cached_lock();
+    lock_state state;
+    unsigned int token; // of the grant we cache
+    bool token_used; // handed out to one of our threads already
+    unsigned int owner; // of the thread that got the grant, see owner()
+    unsigned int grants; // from the server so far, see keep_alive
+    bool revoked; // give it back once no local thread holds it
+    bool lost; // the server took it back while a local thread held it
+    pthread_cond_t c; // state changed
+  };
+  rpcs *rlsrpc;
+  std::string id; // where our revoke handler listens
+  pthread_mutex_t m;
+  std::unordered_map<lock_protocol::lockid_t, cached_lock> locks;
+  // revoked locks nobody here holds, for the releaser thread
+  std::vector<lock_protocol::lockid_t> to_release;
+  pthread_cond_t release_c;
+  bool stopping;
+  pthread_t releaser_th;
+  // per server, from subscribe: its lease period in ms, 0 for none
+  std::vector<int> lease_ms;
+  int keep_alive_ms();
+  void give_back(lock_protocol::lockid_t, cached_lock &);
+  void keep_alive();
+  void releaser();
+ public:
+  // learns that a watched lock was released, and whether it was still
+  // free when the server said so (a waiter may have been granted it)
+  typedef std::function<void(lock_protocol::lockid_t, bool free)>
+      watch_callback;
+ private:
+  std::unordered_map<lock_protocol::lockid_t, std::vector<watch_callback> >
+      watchers;
+  void fire_watchers(lock_protocol::lockid_t, bool free);
+ public:
+  lock_client_cache(std::string xdst);
+  // gives every cached lock back; none may be held locally
+  virtual ~lock_client_cache();
+  // a local reacquire that asks for the token only reuses the cached
+  // grant if its token was not handed out yet; otherwise the lock goes
+  // back to the server for a new grant and token
+  lock_protocol::status acquire(lock_protocol::lockid_t,
+                                unsigned int *token = NULL);
+  lock_protocol::status release(lock_protocol::lockid_t);
+  // cb runs once, the next time the lock is released at the server, on
+  // the thread that handles the server's callbacks, so it should not
+  // block. if the lock is free already it runs before watch returns.
+  // this replaces polling stat() to wait for a lock without queueing.
+  lock_protocol::status watch(lock_protocol::lockid_t, watch_callback cb);
+  rlock_protocol::status revoke_handler(lock_protocol::lockid_t, int &);
+  rlock_protocol::status notify_handler(lock_protocol::lockid_t, int free,
+                                        int &);
+};
+
+
+#endif
@@ -27,4 +27,19 @@ main(int argc, char *argv[])
   lc = new lock_client(dst);
   r = lc->stat(1);
   printf ("stat returned %d\n", r);
+
+  std::map<std::string, unsigned long long> ts;
+  lc->table_stat(ts);
+  std::map<std::string, unsigned long long>::iterator it;
+  for (it = ts.begin(); it != ts.end(); it++)
+    printf ("%s %llu\n", it->first.c_str(), it->second);
+
+  std::vector<lock_protocol::lock_stats> top;
+  lc->top_locks(10, top);
+  printf ("%16s %10s %10s %12s %12s %7s %10s\n", "lock", "acquires", "waits",
+          "wait_us", "max_hold_us", "waiters", "token");
+  for (unsigned i = 0; i < top.size(); i++)
+    printf ("%016llx %10llu %10llu %12llu %12llu %7u %10u\n", top[i].lid,
+            top[i].acquires, top[i].waits, top[i].wait_us,
+            top[i].max_hold_us, top[i].waiters, top[i].token);
 }
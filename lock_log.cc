@@ -0,0 +1,532 @@
+// lock server write-ahead log
+
+#include "lock_log.h"
+#include "slock.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// an entry: op, clt, lid, lsn, token, xid, 4 bytes of padding, checksum
+// of the rest
+static const size_t entry_size = 40;
+static const unsigned int snapshot_magic = 0x6c6b7370;
+
+static void
+put32(char *p, unsigned int v)
+{
+  memcpy(p, &v, 4);
+}
+
+static void
+put64(char *p, unsigned long long v)
+{
+  memcpy(p, &v, 8);
+}
+
+static unsigned int
+get32(const char *p)
+{
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static unsigned long long
+get64(const char *p)
+{
+  unsigned long long v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+// FNV-1a; enough to tell a torn write at the end of a segment
+static unsigned int
+checksum(const char *p, size_t n)
+{
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ (unsigned char)p[i]) * 16777619u;
+  return h;
+}
+
+// reads exactly n bytes, or returns false at the end of the file
+static bool
+read_all(int f, char *b, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t r = read(f, b, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    b += r;
+    n -= r;
+  }
+  return true;
+}
+
+lock_log::lock_log(const std::string &xdir)
+    : dir(xdir), next_lsn(1), durable_lsn(1), flushing(false), fd(-1),
+      gen(0), first_gen(0), bytes(0)
+{
+  if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+  {
+    perror("lock_log: mkdir");
+    assert(0);
+  }
+  pthread_mutex_init(&m, NULL);
+  pthread_cond_init(&flushed_c, NULL);
+}
+
+lock_log::~lock_log()
+{
+  sync();
+  if (fd >= 0)
+    close(fd);
+  pthread_mutex_destroy(&m);
+  pthread_cond_destroy(&flushed_c);
+}
+
+std::string
+lock_log::segment(unsigned long long g)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/log.%llu", g);
+  return dir + name;
+}
+
+void
+lock_log::open_segment()
+{
+  fd = open(segment(gen).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    perror("lock_log: open");
+    assert(0);
+  }
+  bytes = 0;
+}
+
+void
+lock_log::write_all(int f, const char *b, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t r = write(f, b, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+    {
+      perror("lock_log: write");
+      assert(0);
+    }
+    b += r;
+    n -= r;
+  }
+}
+
+// reads exactly n bytes of a snapshot, which must be there
+static void
+read_snapshot(int f, char *b, size_t n)
+{
+  if (!read_all(f, b, n))
+  {
+    fprintf(stderr, "lock_log: snapshot is cut short\n");
+    assert(0);
+  }
+}
+
+void
+lock_log::recover(state_map &locks, sem_map &sems, unsigned int &max_token,
+                  unsigned int &nonce, xid_map &rxids)
+{
+  max_token = 0;
+  nonce = 0;
+  gen = 0;
+  xids.clear();
+
+  int f = open((dir + "/snapshot").c_str(), O_RDONLY);
+  if (f >= 0)
+  {
+    char h[40];
+    read_snapshot(f, h, sizeof(h));
+    if (get32(h) != snapshot_magic)
+    {
+      fprintf(stderr, "lock_log: %s/snapshot is not a snapshot\n",
+              dir.c_str());
+      assert(0);
+    }
+    max_token = get32(h + 4);
+    nonce = get32(h + 8);
+    unsigned int nxids = get32(h + 12);
+    gen = get64(h + 16);
+    unsigned long long n = get64(h + 24);
+    for (unsigned long long i = 0; i < n; i++)
+    {
+      char l[24];
+      read_snapshot(f, l, sizeof(l));
+      lock_state &s = locks[get64(l)];
+      s.lsn = get64(l + 8);
+      s.token = get32(l + 16);
+      unsigned int nholders = get32(l + 20);
+      for (unsigned int j = 0; j < nholders; j++)
+      {
+        char hd[12];
+        read_snapshot(f, hd, sizeof(hd));
+        s.holders.push_back(hold((int)get32(hd), get32(hd + 4) != 0,
+                                 get32(hd + 8)));
+      }
+      if (s.lsn >= next_lsn)
+        next_lsn = s.lsn + 1;
+    }
+    unsigned long long nsems = get64(h + 32);
+    for (unsigned long long i = 0; i < nsems; i++)
+    {
+      char l[24];
+      read_snapshot(f, l, sizeof(l));
+      sem_state &s = sems[get64(l)];
+      s.lsn = get64(l + 8);
+      s.capacity = get32(l + 16);
+      unsigned int nheld = get32(l + 20);
+      for (unsigned int j = 0; j < nheld; j++)
+      {
+        char hd[12];
+        read_snapshot(f, hd, sizeof(hd));
+        s.held[(int)get32(hd)] = get32(hd + 4);
+        s.xids[(int)get32(hd)] = get32(hd + 8);
+      }
+      if (s.lsn >= next_lsn)
+        next_lsn = s.lsn + 1;
+    }
+    for (unsigned int i = 0; i < nxids; i++)
+    {
+      char x[8];
+      read_snapshot(f, x, sizeof(x));
+      note_xid(xids, (int)get32(x), get32(x + 4));
+    }
+    close(f);
+  }
+  first_gen = gen;
+
+  // a crash may have left segments newer than the snapshot
+  for (;; gen++)
+  {
+    f = open(segment(gen).c_str(), O_RDONLY);
+    if (f < 0)
+      break;
+    replay(f, locks, sems, max_token, nonce);
+    close(f);
+  }
+
+  state_map::iterator it;
+  for (it = locks.begin(); it != locks.end();)
+  {
+    if (it->second.holders.empty())
+      it = locks.erase(it);
+    else
+      it++;
+  }
+  durable_lsn = next_lsn;
+  // kept until the next snapshot has them
+  rxids = xids;
+  open_segment();
+}
+
+void
+lock_log::note_xid(xid_map &x, int clt, unsigned int xid)
+{
+  if (xid == 0)
+    return;
+  unsigned int &v = x[clt];
+  if (xid > v)
+    v = xid;
+}
+
+void
+lock_log::replay(int f, state_map &locks, sem_map &sems,
+                 unsigned int &max_token, unsigned int &nonce)
+{
+  char e[entry_size];
+  // the first entry that does not check out is where a write was torn
+  while (read_all(f, e, entry_size) &&
+         get32(e + entry_size - 4) == checksum(e, entry_size - 4))
+  {
+    unsigned int op = get32(e);
+    int clt = (int)get32(e + 4);
+    lock_protocol::lockid_t lid = get64(e + 8);
+    unsigned long long lsn = get64(e + 16);
+    unsigned int token = get32(e + 24);
+    unsigned int xid = get32(e + 28);
+    if (lsn >= next_lsn)
+      next_lsn = lsn + 1;
+    if (op == NONCE)
+    {
+      nonce = token;
+      continue;
+    }
+    note_xid(xids, clt, xid);
+
+    if (op == SEM_INIT || op == SEM_GRANT || op == SEM_RELEASE)
+    {
+      sem_state &ss = sems[lid];
+      if (lsn <= ss.lsn)
+        continue;
+      ss.lsn = lsn;
+      std::map<int, unsigned int>::iterator hi = ss.held.find(clt);
+      if (op == SEM_INIT)
+        ss.capacity = token;
+      else if (op == SEM_GRANT)
+      {
+        ss.held[clt] += token;
+        ss.xids[clt] = xid;
+      }
+      else if (hi != ss.held.end() && hi->second > token)
+        hi->second -= token;
+      else if (hi != ss.held.end())
+      {
+        ss.held.erase(hi);
+        ss.xids.erase(clt);
+      }
+      continue;
+    }
+
+    lock_state &s = locks[lid];
+    if (lsn <= s.lsn)
+      continue; // already in the snapshot
+    s.lsn = lsn;
+    std::vector<hold> &h = s.holders;
+    unsigned i = 0;
+    while (i < h.size() && h[i].clt != clt)
+      i++;
+    switch (op)
+    {
+    case GRANT:
+      // an upgrade makes an existing shared hold exclusive
+      if (i < h.size() && !h[i].exclusive)
+      {
+        h[i].exclusive = true;
+        h[i].xid = xid;
+      }
+      else
+        h.push_back(hold(clt, true, xid));
+      break;
+    case GRANT_SHARED:
+      h.push_back(hold(clt, false, xid));
+      break;
+    case RELEASE:
+      if (i < h.size())
+        h.erase(h.begin() + i);
+      break;
+    case DOWNGRADE:
+      if (i < h.size())
+        h[i].exclusive = false;
+      break;
+    }
+    if (op == GRANT || op == GRANT_SHARED)
+    {
+      s.token = token;
+      if (token > max_token)
+        max_token = token;
+    }
+  }
+}
+
+unsigned long long
+lock_log::append(op_t op, lock_protocol::lockid_t lid, int clt,
+                 unsigned int token, unsigned int xid)
+{
+  char e[entry_size];
+  ScopedLock ml(&m);
+  unsigned long long lsn = next_lsn++;
+  put32(e, op);
+  put32(e + 4, (unsigned int)clt);
+  put64(e + 8, lid);
+  put64(e + 16, lsn);
+  put32(e + 24, token);
+  put32(e + 28, xid);
+  put32(e + 32, 0);
+  put32(e + 36, checksum(e, entry_size - 4));
+  if (op != NONCE)
+    note_xid(xids, clt, xid);
+  buf.append(e, entry_size);
+  return lsn;
+}
+
+void
+lock_log::sync()
+{
+  ScopedLock ml(&m);
+  unsigned long long target = next_lsn;
+  while (durable_lsn < target)
+  {
+    if (flushing)
+    {
+      // the write in progress may not include our entries; look again
+      // once it is done
+      pthread_cond_wait(&flushed_c, &m);
+      continue;
+    }
+    flushing = true;
+    std::string b;
+    b.swap(buf);
+    unsigned long long upto = next_lsn;
+    int f = fd;
+    pthread_mutex_unlock(&m);
+    write_all(f, b.data(), b.size());
+    if (fsync(f) < 0)
+    {
+      perror("lock_log: fsync");
+      assert(0);
+    }
+    pthread_mutex_lock(&m);
+    bytes += b.size();
+    durable_lsn = upto;
+    flushing = false;
+    pthread_cond_broadcast(&flushed_c);
+  }
+}
+
+unsigned long long
+lock_log::rotate()
+{
+  ScopedLock ml(&m);
+  while (flushing)
+    pthread_cond_wait(&flushed_c, &m);
+  write_all(fd, buf.data(), buf.size());
+  if (fsync(fd) < 0)
+  {
+    perror("lock_log: fsync");
+    assert(0);
+  }
+  buf.clear();
+  durable_lsn = next_lsn;
+  pthread_cond_broadcast(&flushed_c);
+  xid_map::iterator it;
+  for (it = xids.begin(); it != xids.end(); it++)
+    note_xid(rotated_xids, it->first, it->second);
+  xids.clear();
+  close(fd);
+  gen++;
+  open_segment();
+  return gen;
+}
+
+void
+lock_log::snapshot(unsigned long long sgen,
+                   const std::vector<std::pair<lock_protocol::lockid_t,
+                                               lock_state> > &locks,
+                   const std::vector<std::pair<lock_protocol::lockid_t,
+                                               sem_state> > &sems,
+                   unsigned int max_token, unsigned int nonce)
+{
+  xid_map sxids;
+  {
+    ScopedLock ml(&m);
+    sxids.swap(rotated_xids);
+  }
+  std::string b;
+  char h[40];
+  memset(h, 0, sizeof(h));
+  put32(h, snapshot_magic);
+  put32(h + 4, max_token);
+  put32(h + 8, nonce);
+  put32(h + 12, sxids.size());
+  put64(h + 16, sgen);
+  put64(h + 24, locks.size());
+  put64(h + 32, sems.size());
+  b.append(h, sizeof(h));
+  for (unsigned i = 0; i < locks.size(); i++)
+  {
+    const lock_state &s = locks[i].second;
+    char l[24];
+    put64(l, locks[i].first);
+    put64(l + 8, s.lsn);
+    put32(l + 16, s.token);
+    put32(l + 20, s.holders.size());
+    b.append(l, sizeof(l));
+    for (unsigned j = 0; j < s.holders.size(); j++)
+    {
+      char hd[12];
+      put32(hd, (unsigned int)s.holders[j].clt);
+      put32(hd + 4, s.holders[j].exclusive);
+      put32(hd + 8, s.holders[j].xid);
+      b.append(hd, sizeof(hd));
+    }
+  }
+  for (unsigned i = 0; i < sems.size(); i++)
+  {
+    const sem_state &s = sems[i].second;
+    char l[24];
+    put64(l, sems[i].first);
+    put64(l + 8, s.lsn);
+    put32(l + 16, s.capacity);
+    put32(l + 20, s.held.size());
+    b.append(l, sizeof(l));
+    std::map<int, unsigned int>::const_iterator j;
+    for (j = s.held.begin(); j != s.held.end(); j++)
+    {
+      std::map<int, unsigned int>::const_iterator x = s.xids.find(j->first);
+      char hd[12];
+      put32(hd, (unsigned int)j->first);
+      put32(hd + 4, j->second);
+      put32(hd + 8, x == s.xids.end() ? 0 : x->second);
+      b.append(hd, sizeof(hd));
+    }
+  }
+  xid_map::iterator it;
+  for (it = sxids.begin(); it != sxids.end(); it++)
+  {
+    char x[8];
+    put32(x, (unsigned int)it->first);
+    put32(x + 4, it->second);
+    b.append(x, sizeof(x));
+  }
+
+  // the rename makes the new snapshot replace the old one all at once
+  std::string tmp = dir + "/snapshot.tmp";
+  int f = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (f < 0)
+  {
+    perror("lock_log: open snapshot");
+    assert(0);
+  }
+  write_all(f, b.data(), b.size());
+  if (fsync(f) < 0)
+  {
+    perror("lock_log: fsync snapshot");
+    assert(0);
+  }
+  close(f);
+  if (rename(tmp.c_str(), (dir + "/snapshot").c_str()) < 0)
+  {
+    perror("lock_log: rename snapshot");
+    assert(0);
+  }
+  int d = open(dir.c_str(), O_RDONLY);
+  if (d >= 0)
+  {
+    fsync(d);
+    close(d);
+  }
+
+  unsigned long long first;
+  {
+    ScopedLock ml(&m);
+    first = first_gen;
+    first_gen = sgen;
+  }
+  for (unsigned long long g = first; g < sgen; g++)
+    unlink(segment(g).c_str());
+}
+
+unsigned long long
+lock_log::segment_bytes()
+{
+  ScopedLock ml(&m);
+  return bytes + buf.size();
+}
@@ -0,0 +1,122 @@
+// lock server write-ahead log.
+
+#ifndef lock_log_h
+#define lock_log_h
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <map>
+#include <pthread.h>
+#include "lock_protocol.h"
+
+// An append-only log of the lock server's grants and releases, and of
+// its semaphores' units, plus snapshots of the locks and semaphores, in
+// one directory. A restarted server
+// reads the latest snapshot and replays the log written after it.
+//
+// append() only buffers an entry. sync() returns once everything
+// appended so far is on disk; whichever caller finds no write in
+// progress writes and fsyncs for all of them, so concurrent syncs
+// share one fsync (group commit).
+//
+// The log is split into segments, log.<gen>. rotate() starts the next
+// one, and a snapshot tagged with that gen makes the older segments
+// unnecessary. Entries and snapshots are in host byte order.
+class lock_log {
+ public:
+  // the SEM_ ops are about semaphore lid; their token is the capacity
+  // for SEM_INIT and the units for the others
+  enum op_t { GRANT = 1, GRANT_SHARED, RELEASE, DOWNGRADE, NONCE,
+              SEM_INIT, SEM_GRANT, SEM_RELEASE };
+
+  // a client holding a lock, and the xid of the request that got it
+  // the lock, so that the request can be told apart when a client sends
+  // it again after a restart
+  struct hold {
+    hold(int xclt, bool xexclusive, unsigned int xxid)
+        : clt(xclt), exclusive(xexclusive), xid(xxid) {}
+    int clt;
+    bool exclusive;
+    unsigned int xid;
+  };
+
+  // what the log knows about one lock
+  struct lock_state {
+    lock_state() : token(0), lsn(0) {}
+    unsigned int token; // of its latest grant
+    unsigned long long lsn; // of the latest entry about it
+    std::vector<hold> holders;
+  };
+  typedef std::unordered_map<lock_protocol::lockid_t, lock_state> state_map;
+
+  // what the log knows about one semaphore
+  struct sem_state {
+    sem_state() : capacity(0), lsn(0) {}
+    unsigned int capacity;
+    unsigned long long lsn; // of the latest entry about it
+    std::map<int, unsigned int> held; // units by client
+    std::map<int, unsigned int> xids; // of each holder's latest grant
+  };
+  typedef std::unordered_map<lock_protocol::lockid_t, sem_state> sem_map;
+  // the largest xid logged for each client. the restarted server's rpcs
+  // has no reply window, so a request at or below it was done already.
+  typedef std::unordered_map<int, unsigned int> xid_map;
+
+  lock_log(const std::string &dir);
+  ~lock_log();
+
+  // rebuilds the logged state: the locks with holders, the semaphores,
+  // the largest token ever granted, the rpcs nonce (0 if none was
+  // logged), and the clients' largest xids
+  void recover(state_map &locks, sem_map &sems, unsigned int &max_token,
+               unsigned int &nonce, xid_map &xids);
+
+  // buffers an entry for the request xid (0 if the server acted on its
+  // own) and returns its log sequence number. entries about one lock or
+  // semaphore must be appended in the order they happen.
+  unsigned long long append(op_t op, lock_protocol::lockid_t lid, int clt,
+                            unsigned int token, unsigned int xid = 0);
+  void sync();
+
+  // makes the entries appended from now on go to a new segment, and
+  // returns its gen
+  unsigned long long rotate();
+  // snapshot of the locks held and the semaphores once the segment gen
+  // started; an entry about one is replayed on top of it only if it is
+  // newer than its lsn. it also keeps the xids of the segments it
+  // replaces. drops the segments before gen.
+  void snapshot(unsigned long long gen,
+                const std::vector<std::pair<lock_protocol::lockid_t,
+                                            lock_state> > &locks,
+                const std::vector<std::pair<lock_protocol::lockid_t,
+                                            sem_state> > &sems,
+                unsigned int max_token, unsigned int nonce);
+  // bytes written to the current segment
+  unsigned long long segment_bytes();
+
+ private:
+  std::string dir;
+  pthread_mutex_t m;
+  pthread_cond_t flushed_c;
+  std::string buf; // appended, not written yet
+  unsigned long long next_lsn;
+  unsigned long long durable_lsn; // everything below is on disk
+  bool flushing;
+  int fd;
+  unsigned long long gen; // of the current segment
+  unsigned long long first_gen; // oldest segment still on disk
+  unsigned long long bytes;
+  xid_map xids; // of the entries since the last rotate, and recovered ones
+  xid_map rotated_xids; // of the segments the next snapshot replaces
+
+  std::string segment(unsigned long long g);
+  void open_segment();
+  void write_all(int f, const char *b, size_t n);
+  void replay(int f, state_map &locks, sem_map &sems,
+              unsigned int &max_token, unsigned int &nonce);
+  void note_xid(xid_map &x, int clt, unsigned int xid);
+};
+
+#endif
@@ -7,15 +7,75 @@
 
 class lock_protocol {
  public:
-  enum xxstatus { OK, RETRY, RPCERR, NOENT, IOERR };
+  // DEADLOCK: waiting would have closed a cycle of client threads
+  // each waiting for a lock the next one holds; the caller should
+  // release what it holds and start over
+  enum xxstatus { OK, RETRY, RPCERR, NOENT, IOERR, DEADLOCK };
   typedef int status;
   typedef unsigned long long lockid_t;
   enum rpc_numbers {
     acquire = 0x7001,
     release,
-    subscribe,	// for lab 5
-    stat
+    subscribe,	// where to send the caller's revoke callbacks; gets the lease
+    stat,
+    acquire_shared,
+    upgrade,	// shared -> exclusive
+    downgrade,	// exclusive -> shared
+    acquire_many,
+    release_many,
+    renew,	// extend the caller's lease on a lock it holds
+    try_acquire,	// acquire, or give up with RETRY after a timeout
+    table_stat,	// size of the lock table
+    lock_stat,	// contention counters of one lock
+    top_locks,	// counters of the most contended locks
+    sem_init,	// create a semaphore, or change its capacity
+    sem_acquire,	// take n units, waiting behind earlier requests
+    sem_release,	// give back n units
+    watch	// notify the caller when a lock is next released
+  };
+
+  // how busy a lock has been since its record was created
+  struct lock_stats {
+    lockid_t lid;
+    unsigned long long acquires; // grants, shared ones included
+    unsigned long long waits; // acquires that had to queue
+    unsigned long long wait_us; // total time spent queued
+    unsigned long long max_hold_us; // longest hold released so far
+    unsigned int waiters; // queued right now
+    unsigned int token; // fencing token of the latest grant
+    // more contended: more time spent waiting for it, then more acquires
+    bool hotter(const lock_stats &o) const
+    {
+      if (wait_us != o.wait_us)
+        return wait_us > o.wait_us;
+      return acquires > o.acquires;
+    }
+  };
+};
+
+// callbacks from the lock server to a caching client (lock_client_cache)
+class rlock_protocol {
+ public:
+  enum xxstatus { OK, RPCERR };
+  typedef int status;
+  enum rpc_numbers {
+    revoke = 0x8001,	// somebody is waiting for a lock the client holds
+    notify	// a watched lock was released; says whether it is free now
   };
 };
 
+inline marshall &
+operator<<(marshall &m, const lock_protocol::lock_stats &s)
+{
+  return m << s.lid << s.acquires << s.waits << s.wait_us << s.max_hold_us
+           << s.waiters << s.token;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, lock_protocol::lock_stats &s)
+{
+  return u >> s.lid >> s.acquires >> s.waits >> s.wait_us >> s.max_hold_us
+           >> s.waiters >> s.token;
+}
+
 #endif 
@@ -0,0 +1,67 @@
+#ifndef lock_ring_h
+#define lock_ring_h
+
+// consistent hashing of lock ids onto the lock servers of a cluster
+// every shard owns the arcs of a hash ring that end at its points, so
+// going from N to N+1 shards moves only about 1/(N+1) of the locks,
+// and many points per shard keep the arcs about even. the ring depends
+// only on the number of shards: clients and servers that agree on N
+// agree on which shard owns a lock.
+
+#include <assert.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "lock_protocol.h"
+
+class lock_ring
+{
+public:
+  lock_ring(unsigned int nshards = 1);
+  unsigned int size() const { return n; }
+  unsigned int shard_of(lock_protocol::lockid_t lid) const;
+
+private:
+  enum { POINTS = 128 }; // per shard
+  // splitmix64: lock ids are often small and consecutive
+  static unsigned long long mix(unsigned long long x);
+  unsigned int n;
+  std::vector<std::pair<unsigned long long, unsigned int> > points;
+};
+
+inline unsigned long long
+lock_ring::mix(unsigned long long x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+inline
+lock_ring::lock_ring(unsigned int nshards) : n(nshards)
+{
+  assert(n > 0);
+  for (unsigned int s = 0; n > 1 && s < n; s++)
+  {
+    for (unsigned int p = 0; p < POINTS; p++)
+    {
+      unsigned long long k = ((unsigned long long)s << 32) | p;
+      points.push_back(std::make_pair(mix(~k), s));
+    }
+  }
+  std::sort(points.begin(), points.end());
+}
+
+inline unsigned int
+lock_ring::shard_of(lock_protocol::lockid_t lid) const
+{
+  if (n == 1)
+    return 0;
+  std::pair<unsigned long long, unsigned int> key(mix(lid), 0);
+  std::vector<std::pair<unsigned long long, unsigned int> >::const_iterator
+      it = std::lower_bound(points.begin(), points.end(), key);
+  return it == points.end() ? points[0].second : it->second;
+}
+
+#endif
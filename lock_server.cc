@@ -1,72 +1,1979 @@
 // the lock server implementation
 
 #include "lock_server.h"
+#include "slock.h"
+#include "method_thread.h"
+#include "gettime.h"
 #include <sstream>
 #include <stdio.h>
+#include <assert.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <unordered_map>
+#include <algorithm>
+#include <tuple>
+#include <set>
 
-lock_server::lock_server() : nacquire(0)
+// granularity of lease expiry and try_acquire deadlines
+static const unsigned int timer_tick_ms = 10;
+// how often the table is swept for idle records; one unused for a whole
+// period is freed
+static const unsigned int sweep_ms = 1000;
+// a log segment this big is replaced by a snapshot and a new segment
+static const unsigned long long checkpoint_bytes = 64ULL << 20;
+// how long a failed revoke waits before it is sent again
+static const unsigned int callback_retry_ms = 100;
+
+static unsigned long long
+now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static unsigned long long
+now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// the wait counters have a single writer at a time (whoever holds
+// rec->m), so they need no atomic read-modify-write; the atomics are only
+// there so that stat readers can skip rec->m. acquires and max_hold_us
+// are also written by the fast path, and use real atomic updates.
+template<class T> static void
+bump(std::atomic<T> &c, T v)
+{
+  c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+template<class T> static void
+raise_to(std::atomic<T> &c, T v)
+{
+  T cur = c.load(std::memory_order_relaxed);
+  while (v > cur && !c.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+    ;
+}
+
+lock_server::lock_record::lock_record()
+    : upgrader(NULL), upgrader_clt(0), upgrader_owner(0), acquires(0),
+      waits(0), wait_us(0),
+      max_hold_us(0), nwaiters(0), token(0), state(FREE), fast_since(0), refs(0),
+      lid(0), held(false), idle(false), lsn(0), in_wfg(false)
+{
+  pthread_mutex_init(&m, NULL);
+}
+
+lock_server::lock_record::~lock_record()
+{
+  pthread_mutex_destroy(&m);
+}
+
+// the hold of clt's thread owner if there is one, or else any of clt's
+lock_server::holder *
+lock_server::lock_record::find_holder(int clt, unsigned int owner)
+{
+  holder *any = NULL;
+  for (unsigned i = 0; i < holders.size(); i++)
+  {
+    if (holders[i].clt != clt)
+      continue;
+    if (owner == 0 || holders[i].owner == owner)
+      return &holders[i];
+    if (any == NULL)
+      any = &holders[i];
+  }
+  return any;
+}
+
+// removes holders[i], noting how long it held the lock. caller holds m.
+void
+lock_server::lock_record::drop_holder(unsigned i, unsigned long long now)
+{
+  raise_to(max_hold_us, now - holders[i].since);
+  holders.erase(holders.begin() + i);
+}
+
+// takes the lock for clt without m if it is free and uncontended
+bool
+lock_server::lock_record::fast_acquire(int clt, unsigned int owner,
+                                       unsigned int &xtoken)
+{
+  unsigned long long s = FREE;
+  if (!state.compare_exchange_strong(s, held_by(clt, owner)))
+    return false;
+  fast_since.store(now_us(), std::memory_order_relaxed);
+  acquires.fetch_add(1, std::memory_order_relaxed);
+  xtoken = token.fetch_add(1, std::memory_order_relaxed) + 1;
+  return true;
+}
+
+// releases a hold taken by fast_acquire, unless contention has moved it
+// into holders meanwhile
+bool
+lock_server::lock_record::fast_release(int clt)
+{
+  unsigned long long since = fast_since.load(std::memory_order_relaxed);
+  unsigned long long s = state.load();
+  if ((s & 3) != FAST_HELD || (int)(s >> 32) != clt ||
+      !state.compare_exchange_strong(s, FREE))
+    return false;
+  raise_to(max_hold_us, now_us() - since);
+  return true;
+}
+
+lock_server::slow_lock::slow_lock(lock_record *xrec) : rec(xrec)
+{
+  pthread_mutex_lock(&rec->m);
+  unsigned long long s = rec->state.load();
+  while (s != lock_record::SLOW)
+  {
+    if (!rec->state.compare_exchange_weak(s, lock_record::SLOW))
+      continue;
+    assert(rec->holders.empty());
+    if (s != lock_record::FREE)
+    {
+      // a fast holder; its hold is timed from here on
+      rec->held = true;
+      rec->holders.push_back(holder((int)(s >> 32), (s & 0xffffffff) >> 2,
+                                    0));
+      rec->holders.back().since = now_us();
+    }
+    break;
+  }
+}
+
+lock_server::slow_lock::~slow_lock()
+{
+  if (rec->unused())
+    rec->state.store(lock_record::FREE);
+  pthread_mutex_unlock(&rec->m);
+}
+
+// a snapshot of the counters; needs no mutex, but the values may be
+// from slightly different moments
+void
+lock_server::lock_record::read_stats(lock_protocol::lockid_t lid,
+                                     lock_protocol::lock_stats &r)
+{
+  r.lid = lid;
+  r.acquires = acquires.load(std::memory_order_relaxed);
+  r.waits = waits.load(std::memory_order_relaxed);
+  r.wait_us = wait_us.load(std::memory_order_relaxed);
+  r.max_hold_us = max_hold_us.load(std::memory_order_relaxed);
+  r.waiters = nwaiters.load(std::memory_order_relaxed);
+  r.token = token.load(std::memory_order_relaxed);
+}
+
+lock_server::lock_shard::lock_shard() : reclaimed(0)
+{
+  pthread_mutex_init(&m, NULL);
+}
+
+lock_server::lock_shard::~lock_shard()
+{
+  pthread_mutex_destroy(&m);
+}
+
+// whether nobody is looking through the slot. readers stay for a few
+// instructions, so this only spins briefly before giving up.
+bool
+lock_server::index_slot::quiet()
 {
-  pthread_mutex_init(&lock_state_lock, NULL);
+  for (int i = 0; i < 1000; i++)
+    if (readers.load() == 0)
+      return true;
+  return false;
 }
 
+lock_server::lock_server(int xlease_ms, int xgrace_ms,
+                         const std::string &log_dir, unsigned int xshard,
+                         unsigned int nservers)
+    : token_floor(0), lease_ms(xlease_ms), timers(now_ms() / timer_tick_ms),
+      next_timer_id(1), stopping(false), grace_ms(xgrace_ms), wal(NULL),
+      nonce(0), ring(nservers), shard(xshard), nwatched(0)
+{
+  // a few shards per core keeps the chance of two busy dispatch threads
+  // colliding on a shard low; a power of two lets shard_of() mask
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1)
+    ncpu = 1;
+  nshards = 1;
+  while (nshards < 4 * (unsigned long)ncpu)
+    nshards <<= 1;
+  shards = new lock_shard[nshards];
+
+  pthread_mutex_init(&timer_m, NULL);
+  pthread_mutex_init(&subscribers_m, NULL);
+  pthread_mutex_init(&callbacks_m, NULL);
+  pthread_cond_init(&callbacks_c, NULL);
+  pthread_mutex_init(&lost_m, NULL);
+  pthread_mutex_init(&batches_m, NULL);
+  pthread_mutex_init(&wfg_m, NULL);
+  pthread_mutex_init(&sems_m, NULL);
+  pthread_mutex_init(&watches_m, NULL);
+  if (!log_dir.empty())
+  {
+    wal = new lock_log(log_dir);
+    restore();
+  }
+  timer_th = method_thread(this, false, &lock_server::timer_loop);
+  callback_th = method_thread(this, false, &lock_server::callback_loop);
+}
+
+lock_server::~lock_server()
+{
+  stopping = true;
+  pthread_join(timer_th, NULL);
+  {
+    ScopedLock cl(&callbacks_m);
+    pthread_cond_signal(&callbacks_c);
+  }
+  pthread_join(callback_th, NULL);
+  pthread_mutex_destroy(&timer_m);
+  pthread_mutex_destroy(&subscribers_m);
+  pthread_mutex_destroy(&callbacks_m);
+  pthread_cond_destroy(&callbacks_c);
+  pthread_mutex_destroy(&lost_m);
+  pthread_mutex_destroy(&batches_m);
+  pthread_mutex_destroy(&wfg_m);
+  pthread_mutex_destroy(&sems_m);
+  pthread_mutex_destroy(&watches_m);
+  delete wal;
+  delete[] shards;
+}
+
+lock_server::lock_shard &
+lock_server::shard_of(lock_protocol::lockid_t lid)
+{
+  // lock ids are often small consecutive integers, so mix the bits
+  // before picking a shard
+  unsigned long long h = lid * 0x9e3779b97f4a7c15ULL;
+  return shards[(h >> 32) & (nshards - 1)];
+}
+
+// lid's slot in its shard's index; other bits than shard_of() uses
+unsigned int
+lock_server::index_of(lock_protocol::lockid_t lid)
+{
+  unsigned long long h = lid * 0x9e3779b97f4a7c15ULL;
+  return (h >> 48) & (lock_shard::INDEX_SLOTS - 1);
+}
+
+// returns the record for lid, or NULL if there is none and create is
+// false. the record comes back pinned, so sweep() cannot free it once
+// we are done looking; use record_ref rather than calling this
+// directly, so the pin is dropped again. a caller that only reads the
+// record passes use = false, so that looking at a lock does not keep
+// its record from being freed.
+//
+// a lock in use is found through the shard's index, without the shard
+// mutex; only the first lookup, and one that lost its slot to another
+// lock, searches the map under the mutex and puts the record (back) in.
+lock_server::lock_record *
+lock_server::get_record(lock_protocol::lockid_t lid, bool create, bool use)
+{
+  lock_shard &s = shard_of(lid);
+  index_slot &is = s.index[index_of(lid)];
+  is.readers++;
+  lock_record *rec = is.rec.load();
+  if (rec && rec->lid == lid)
+    rec->refs++;
+  else
+    rec = NULL;
+  is.readers--;
+  if (rec)
+  {
+    if (use && rec->idle.load(std::memory_order_relaxed))
+      rec->idle = false;
+    return rec;
+  }
+
+  ScopedLock sl(&s.m);
+  std::unordered_map<lock_protocol::lockid_t, lock_record>::iterator it =
+      s.records.find(lid);
+  if (it == s.records.end())
+  {
+    if (!create)
+      return NULL;
+    // printf("[lock_server]New lock found: %llu\n", lid);
+    it = s.records.emplace(std::piecewise_construct, std::forward_as_tuple(lid),
+                           std::forward_as_tuple()).first;
+    it->second.token = token_floor.load();
+    it->second.lid = lid;
+  }
+  it->second.refs++;
+  if (use)
+    it->second.idle = false;
+  is.rec.store(&it->second);
+  return &it->second;
+}
+
+// lid's current fencing token
 lock_protocol::status
 lock_server::stat(int clt, lock_protocol::lockid_t lid, int &r)
 {
-  lock_protocol::status ret = lock_protocol::OK;
-  printf("stat request from clt %d\n", clt);
-  r = nacquire;
-  return ret;
+  record_ref ref(this, lid, false, false);
+  // a lock without a record has had no grant since its last token
+  r = ref.rec ? ref.rec->token.load(std::memory_order_relaxed)
+              : token_floor.load();
+  return lock_protocol::OK;
+}
+
+// a caching client tells us where its revoke handler listens, and
+// learns the lease period in r (0: no leases). it subscribes again from
+// time to time: NOENT says it was not subscribed, which for a client
+// that was means drop_client forgot it, and took back its locks.
+lock_protocol::status
+lock_server::subscribe(int clt, std::string dst, int &r)
+{
+  r = lease_ms;
+  {
+    ScopedLock sl(&subscribers_m);
+    if (subscribers.count(clt))
+      return lock_protocol::OK;
+  }
+  sockaddr_in dstsock;
+  make_sockaddr(dst.c_str(), &dstsock);
+  rpcc *cl = new rpcc(dstsock);
+  if (cl->bind() < 0)
+  {
+    printf("lock_server: cannot bind to clt %u at %s\n", (unsigned)clt,
+           dst.c_str());
+    delete cl;
+    return lock_protocol::RPCERR;
+  }
+  ScopedLock sl(&subscribers_m);
+  if (subscribers.count(clt))
+  {
+    delete cl;
+    return lock_protocol::OK;
+  }
+  subscribers[clt] = new subscriber(cl);
+  return lock_protocol::NOENT;
+}
+
+// clt's subscriber, if it has one, held until put_subscriber so that
+// reap_subscribers leaves its rpcc alone meanwhile
+lock_server::subscriber *
+lock_server::get_subscriber(int clt)
+{
+  ScopedLock sl(&subscribers_m);
+  std::unordered_map<int, subscriber *>::iterator it = subscribers.find(clt);
+  if (it == subscribers.end())
+    return NULL;
+  it->second->calls++;
+  return it->second;
+}
+
+void
+lock_server::put_subscriber(subscriber *s)
+{
+  ScopedLock sl(&subscribers_m);
+  s->calls--;
+}
+
+// deletes the rpcc of retired subscribers nobody uses any more. never
+// called from a callback, which runs on the completion thread of the
+// rpcc that ~rpcc would wait for.
+void
+lock_server::reap_subscribers()
+{
+  std::vector<subscriber *> gone;
+  {
+    ScopedLock sl(&subscribers_m);
+    for (unsigned i = 0; i < retired.size();)
+    {
+      if (retired[i]->calls > 0)
+      {
+        i++;
+        continue;
+      }
+      gone.push_back(retired[i]);
+      retired[i] = retired.back();
+      retired.pop_back();
+    }
+  }
+  for (unsigned i = 0; i < gone.size(); i++)
+  {
+    delete gone[i]->cl;
+    delete gone[i];
+  }
+}
+
+lock_protocol::status
+lock_server::lock_stat(int clt, lock_protocol::lockid_t lid,
+                       lock_protocol::lock_stats &r)
+{
+  record_ref ref(this, lid, false, false);
+  if (ref.rec == NULL)
+    return lock_protocol::NOENT;
+  ref.rec->read_stats(lid, r);
+  return lock_protocol::OK;
+}
+
+static bool
+hotter(const lock_protocol::lock_stats &a, const lock_protocol::lock_stats &b)
+{
+  return a.hotter(b);
+}
+
+// the n most contended locks, hottest first. only one shard mutex is
+// held at a time, and only while walking its map; no lock record mutex
+// is taken, so this never waits behind a busy lock.
+lock_protocol::status
+lock_server::top_locks(int clt, unsigned int n,
+                       std::vector<lock_protocol::lock_stats> &r)
+{
+  // a heap of the best n so far, with the coolest of them at the front
+  std::vector<lock_protocol::lock_stats> top;
+  for (unsigned i = 0; n > 0 && i < nshards; i++)
+  {
+    ScopedLock sl(&shards[i].m);
+    std::unordered_map<lock_protocol::lockid_t, lock_record>::iterator it;
+    for (it = shards[i].records.begin(); it != shards[i].records.end(); it++)
+    {
+      lock_protocol::lock_stats s;
+      it->second.read_stats(it->first, s);
+      if (top.size() == n)
+      {
+        if (!hotter(s, top.front()))
+          continue;
+        std::pop_heap(top.begin(), top.end(), hotter);
+        top.pop_back();
+      }
+      top.push_back(s);
+      std::push_heap(top.begin(), top.end(), hotter);
+    }
+  }
+  std::sort_heap(top.begin(), top.end(), hotter);
+  r.swap(top);
+  return lock_protocol::OK;
+}
+
+// the size of the lock table: records in use, roughly how much memory
+// they take, and how many the sweeper has freed so far
+lock_protocol::status
+lock_server::table_stat(int clt, std::map<std::string, unsigned long long> &r)
+{
+  // a map node holds the key, the record and the next pointer
+  const unsigned long long node_bytes = sizeof(lock_protocol::lockid_t) +
+      sizeof(lock_record) + sizeof(void *);
+  unsigned long long records = 0, bytes = 0, reclaimed = 0;
+  for (unsigned i = 0; i < nshards; i++)
+  {
+    ScopedLock sl(&shards[i].m);
+    records += shards[i].records.size();
+    bytes += shards[i].records.size() * node_bytes +
+             shards[i].records.bucket_count() * sizeof(void *);
+    reclaimed += shards[i].reclaimed;
+  }
+  r["records"] = records;
+  r["record_bytes"] = bytes;
+  r["reclaimed"] = reclaimed;
+  return lock_protocol::OK;
+}
+
+bool
+lock_server::mine(lock_protocol::lockid_t lid)
+{
+  return ring.shard_of(lid) == shard;
+}
+
+// makes w a holder of rec, with the next fencing token. caller holds
+// rec->m.
+void
+lock_server::take(lock_protocol::lockid_t lid, lock_record *rec, waiter &w)
+{
+  w.token = rec->token.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (!w.shared)
+    rec->held = true;
+  rec->holders.push_back(holder(w.clt, w.owner, 0));
+  rec->holders.back().since = now_us();
+  rec->holders.back().xid = w.xid;
+  rec->acquires.fetch_add(1, std::memory_order_relaxed);
+  log_op(w.shared ? lock_log::GRANT_SHARED : lock_log::GRANT, lid, rec,
+         w.clt, w.token, w.xid);
+  // a batch cannot renew before it gets its reply, so its leases only
+  // start once it holds all of its locks (see continue_batch)
+  if (!w.b)
+    start_lease(lid, rec->holders.back());
+}
+
+// grants rec to as many waiters as it can take, in queue order: either
+// one exclusive waiter or every shared waiter up to the next exclusive
+// one. new readers queue behind a waiting writer (see grant_or_park),
+// so a steady stream of readers cannot starve writers. caller holds
+// rec->m and sends the replies once it has dropped it.
+void
+lock_server::grant_waiters(lock_protocol::lockid_t lid, lock_record *rec,
+                           std::vector<waiter> &granted)
+{
+  if (rec->upgrader)
+  {
+    // nobody else gets in while an upgrade waits for readers to leave
+    if (rec->holders.size() == 1)
+    {
+      rec->held = true;
+      start_lease(lid, rec->holders[0]);
+      granted.push_back(waiter(rec->upgrader_clt, rec->upgrader_owner,
+                               rec->upgrader, false));
+      granted.back().token =
+          rec->token.fetch_add(1, std::memory_order_relaxed) + 1;
+      rec->holders[0].xid = granted.back().xid;
+      log_op(lock_log::GRANT, lid, rec, rec->upgrader_clt,
+             granted.back().token, granted.back().xid);
+      rec->upgrader = NULL;
+      wfg_unpark(lid, rec->upgrader_clt, rec->upgrader_owner);
+    }
+    wfg_refresh(lid, rec);
+    return;
+  }
+  unsigned first = granted.size();
+  while (!rec->waiters.empty() && !rec->held)
+  {
+    waiter &w = rec->waiters.front();
+    if (!w.shared && rec->readers() > 0)
+      break;
+    take(lid, rec, w);
+    bump(rec->wait_us, rec->holders.back().since - w.since);
+    granted.push_back(w);
+    rec->waiters.pop_front();
+    rec->nwaiters.store(rec->waiters.size(), std::memory_order_relaxed);
+    wfg_unpark(lid, w.clt, w.owner);
+  }
+  wfg_refresh(lid, rec);
+  for (unsigned i = first; !rec->waiters.empty() && i < granted.size(); i++)
+    granted[i].revoke = true;
+}
+
+void
+lock_server::send_grants(std::vector<waiter> &granted)
+{
+  // sending may block on the socket, so never do it under rec->m
+  if (!granted.empty())
+    log_sync();
+  for (unsigned i = 0; i < granted.size(); i++)
+  {
+    if (granted[i].b)
+      continue_batch(granted[i].b);
+    else
+      granted[i].d->reply(lock_protocol::OK, (int)granted[i].token);
+    if (granted[i].revoke)
+      revoke(granted[i].lid, std::vector<int>(1, granted[i].clt));
+  }
+}
+
+// takes lid for w right away if it is free and nobody is queued for it,
+// and otherwise parks w unless park is false. returns OK if w now holds
+// the lock, RETRY if it does not (a parked w may be granted by another
+// thread as soon as this returns), and DEADLOCK if parking w would
+// have closed a cycle in the wait-for graph; w is the youngest request
+// of the cycle, so it is the one that fails.
+lock_protocol::status
+lock_server::grant_or_park(lock_protocol::lockid_t lid, waiter &w,
+                           bool park)
+{
+  record_ref ref(this, lid, true);
+  lock_record *rec = ref.rec;
+  // a lease needs a holder entry and a timer, and a log entry must be
+  // appended in order with the other changes of rec, so with either
+  // every acquire goes the slow way
+  if (!w.shared && lease_ms <= 0 && !wal &&
+      rec->fast_acquire(w.clt, w.owner, w.token))
+    return lock_protocol::OK;
+
+  std::vector<int> holders;
+  {
+    slow_lock ml(rec);
+    holder *h = rec->find_holder(w.clt);
+    if (h && h->restored && h->xid == w.xid)
+    {
+      // the client sending again an acquire whose reply was lost when
+      // the server went down
+      h->restored = false;
+      w.token = rec->token;
+      return lock_protocol::OK;
+    }
+    bool free = !rec->held && rec->waiters.empty() && !rec->upgrader;
+    if (!free || (!w.shared && rec->readers() > 0))
+    {
+      // printf("[lock_server]Lock %llu is held, waiting...\n", lid);
+      if (!park)
+        return lock_protocol::RETRY;
+      // checked under rec->m: drop_client marks the batch before it
+      // looks at rec, so it either finds the waiter or we see the mark
+      if (w.b && w.b->dropped)
+        return lock_protocol::RPCERR;
+      if (!wfg_park(lid, rec, w.clt, w.owner))
+        return lock_protocol::DEADLOCK;
+      rec->waiters.push_back(w);
+      rec->waiters.back().since = now_us();
+      rec->waiters.back().lid = lid;
+      bump(rec->waits, 1ULL);
+      rec->nwaiters.store(rec->waiters.size(), std::memory_order_relaxed);
+      for (unsigned i = 0; i < rec->holders.size(); i++)
+        holders.push_back(rec->holders[i].clt);
+    }
+    else
+    {
+      // printf("[lock_server]Lock %llu is acquired\n", lid);
+      take(lid, rec, w);
+      return lock_protocol::OK;
+    }
+  }
+  revoke(lid, holders);
+  return lock_protocol::RETRY;
+}
+
+// lid has a waiter: asks those of its holders that are caching clients
+// to give it back once they are done with it. the revokes are only
+// queued (see callback_loop), so this never waits for a client.
+void
+lock_server::revoke(lock_protocol::lockid_t lid, const std::vector<int> &clts)
+{
+  unsigned long long now = 0;
+  for (unsigned i = 0; i < clts.size(); i++)
+  {
+    {
+      ScopedLock sl(&subscribers_m);
+      if (subscribers.count(clts[i]) == 0)
+        continue;
+    }
+    if (now == 0)
+      now = now_ms();
+    queue_callback(callback(clts[i], lid, now));
+  }
+}
+
+void
+lock_server::queue_callback(const callback &c)
+{
+  ScopedLock cl(&callbacks_m);
+  callbacks.push_back(c);
+  pthread_cond_signal(&callbacks_c);
+}
+
+// sends c, unless its client went away. the client only notes the
+// revoke and answers right away.
+void
+lock_server::send_callback(const callback &c)
+{
+  subscriber *s = get_subscriber(c.clt);
+  if (s == NULL)
+    return;
+  if (c.notify >= 0)
+  {
+    s->cl->call_async<int>(rlock_protocol::notify,
+        [this, s, c](int ret, int &) {
+          if (ret != rlock_protocol::OK)
+            printf("lock_server: notify of lock %llu to clt %u failed\n",
+                   c.lid, (unsigned)c.clt);
+          put_subscriber(s);
+        }, rpcc::to(1000), c.lid, c.notify);
+    return;
+  }
+  s->cl->call_async<int>(rlock_protocol::revoke,
+      [this, s, c](int ret, int &) {
+        if (ret != rlock_protocol::OK && revoke_wanted(c.lid, c.clt))
+          queue_callback(callback(c.clt, c.lid, now_ms() + callback_retry_ms));
+        put_subscriber(s);
+      }, rpcc::to(1000), c.lid);
+}
+
+// whether clt still holds lid while somebody waits for it
+bool
+lock_server::revoke_wanted(lock_protocol::lockid_t lid, int clt)
+{
+  record_ref ref(this, lid, false, false);
+  lock_record *rec = ref.rec;
+  // a lock with waiters is never on the fast path
+  if (rec == NULL || rec->state.load() != lock_record::SLOW)
+    return false;
+  ScopedLock ml(&rec->m);
+  return rec->find_holder(clt) && (!rec->waiters.empty() || rec->upgrader);
+}
+
+void
+lock_server::callback_loop()
+{
+  ScopedLock cl(&callbacks_m);
+  while (!stopping)
+  {
+    std::vector<callback> due;
+    unsigned long long now = now_ms();
+    unsigned long long next = now + 1000;
+    std::list<callback>::iterator it;
+    for (it = callbacks.begin(); it != callbacks.end();)
+    {
+      if (it->due > now)
+      {
+        next = std::min(next, it->due);
+        it++;
+        continue;
+      }
+      due.push_back(*it);
+      it = callbacks.erase(it);
+    }
+    if (due.empty())
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      unsigned long long ns = ts.tv_nsec + (next - now) * 1000000ULL;
+      ts.tv_sec += ns / 1000000000ULL;
+      ts.tv_nsec = ns % 1000000000ULL;
+      pthread_cond_timedwait(&callbacks_c, &callbacks_m, &ts);
+      continue;
+    }
+    pthread_mutex_unlock(&callbacks_m);
+    for (unsigned i = 0; i < due.size(); i++)
+      send_callback(due[i]);
+    pthread_mutex_lock(&callbacks_m);
+  }
 }
 
 lock_protocol::status
-lock_server::release(int clt, lock_protocol::lockid_t lid, int &r)
+lock_server::release_one(lock_protocol::lockid_t lid, int clt,
+                         std::vector<waiter> &granted, unsigned int owner,
+                         unsigned int xid)
 {
-  pthread_mutex_lock(&lock_state_lock);
-  if (lock_state.count(lid) == 0)
+  record_ref ref(this, lid, false);
+  lock_record *rec = ref.rec;
+  if (rec == NULL)
     return lock_protocol::RPCERR;
-  pthread_mutex_unlock(&lock_state_lock);
+  if (rec->fast_release(clt))
+    return lock_protocol::OK;
 
-  // printf("[lock_server][%d]Trying to lock- release lock %llu\n", clt, lid);
-  pthread_mutex_lock(&lock_mutex[lid]);
-  if (lock_state[lid] == false)
+  slow_lock ml(rec);
+  holder *h = rec->find_holder(clt, owner);
+  if (h == NULL)
     return lock_protocol::RPCERR;
-  lock_state[lid] = false;
-  // printf("[lock_server][%d]Lock %llu is released\n", clt, lid);
-  pthread_mutex_unlock(&lock_mutex[lid]);
-  pthread_cond_broadcast(&lock_cv[lid]);
+  rec->drop_holder(h - &rec->holders[0], now_us());
+  rec->held = false;
+  log_op(lock_log::RELEASE, lid, rec, clt, 0, xid);
+  // printf("[lock_server]Lock %llu is released\n", lid);
+
+  // the next waiters are granted before rec->m is dropped, so the lock
+  // passes straight to them and a newly arriving acquire cannot barge
+  // in ahead
+  grant_waiters(lid, rec, granted);
   return lock_protocol::OK;
 }
 
+// a release of a lock the client does not hold may be one it sends
+// again because the server went down before replying; the log says
+// whether it was done then.
+void
+lock_server::release(int clt, lock_protocol::lockid_t lid, unsigned int owner,
+                     deferred_reply *d)
+{
+  std::vector<waiter> granted;
+  lock_protocol::status ret = release_one(lid, clt, granted, owner, d->xid());
+  if (ret != lock_protocol::OK && done_before_restart(clt, d->xid()))
+    ret = lock_protocol::OK;
+  log_sync();
+  d->reply(ret, 0);
+  send_grants(granted);
+  notify_watchers(lid);
+}
+
+void
+lock_server::acquire(int clt, lock_protocol::lockid_t lid, unsigned int owner,
+                     deferred_reply *d)
+{
+  if (!mine(lid))
+  {
+    d->reply(lock_protocol::RPCERR, 0);
+    return;
+  }
+  waiter w(clt, owner, d, false);
+  lock_protocol::status ret = grant_or_park(lid, w);
+  if (ret == lock_protocol::OK)
+  {
+    log_sync();
+    d->reply(lock_protocol::OK, (int)w.token);
+  }
+  else if (ret == lock_protocol::DEADLOCK)
+    d->reply(lock_protocol::DEADLOCK, 0);
+}
+
+void
+lock_server::acquire_shared(int clt, lock_protocol::lockid_t lid,
+                            unsigned int owner, deferred_reply *d)
+{
+  if (!mine(lid))
+  {
+    d->reply(lock_protocol::RPCERR, 0);
+    return;
+  }
+  waiter w(clt, owner, d, true);
+  lock_protocol::status ret = grant_or_park(lid, w);
+  if (ret == lock_protocol::OK)
+  {
+    log_sync();
+    d->reply(lock_protocol::OK, (int)w.token);
+  }
+  else if (ret == lock_protocol::DEADLOCK)
+    d->reply(lock_protocol::DEADLOCK, 0);
+}
+
+// turns the caller's shared hold into an exclusive one once the other
+// readers have released. only one upgrade can wait at a time: a second
+// would deadlock with the first, so it fails with RETRY and the caller
+// should release and acquire exclusively instead.
+void
+lock_server::upgrade(int clt, lock_protocol::lockid_t lid, unsigned int owner,
+                     deferred_reply *d)
+{
+  record_ref ref(this, lid, false);
+  lock_record *rec = ref.rec;
+  if (rec == NULL)
+  {
+    d->reply(lock_protocol::RPCERR, 0);
+    return;
+  }
+
+  std::vector<waiter> granted;
+  lock_protocol::status ret = lock_protocol::OK;
+  {
+    slow_lock ml(rec);
+    holder *h = rec->find_holder(clt, owner);
+    if (h && h->restored && h->xid == d->xid() && rec->held)
+    {
+      // sent again after a restart; it went through before
+      h->restored = false;
+      d->reply(lock_protocol::OK, (int)rec->token);
+      return;
+    }
+    if (rec->held || h == NULL)
+      ret = lock_protocol::RPCERR;
+    else if (rec->upgrader)
+      ret = lock_protocol::RETRY;
+    else if (rec->holders.size() > 1 && !wfg_park(lid, rec, clt, owner))
+      ret = lock_protocol::DEADLOCK;
+    else
+    {
+      // blocked here the caller cannot renew, so its lease is suspended
+      // until the upgrade goes through
+      h->expires = 0;
+      // d may be granted and freed by a release as soon as rec->m drops
+      rec->upgrader = d;
+      rec->upgrader_clt = clt;
+      rec->upgrader_owner = owner;
+      grant_waiters(lid, rec, granted);
+    }
+  }
+  if (ret != lock_protocol::OK)
+    d->reply(ret, 0);
+  send_grants(granted);
+}
+
+void
+lock_server::downgrade(int clt, lock_protocol::lockid_t lid, deferred_reply *d)
+{
+  record_ref ref(this, lid, false);
+  lock_record *rec = ref.rec;
+  lock_protocol::status ret = lock_protocol::OK;
+  std::vector<waiter> granted;
+  if (rec == NULL)
+    ret = lock_protocol::RPCERR;
+  else
+  {
+    slow_lock ml(rec);
+    if (!rec->held || rec->holders[0].clt != clt)
+      ret = lock_protocol::RPCERR;
+    else
+    {
+      rec->held = false;
+      log_op(lock_log::DOWNGRADE, lid, rec, clt, 0, d->xid());
+      // readers queued at the front can now share the lock with the
+      // caller
+      grant_waiters(lid, rec, granted);
+    }
+  }
+  if (ret != lock_protocol::OK && done_before_restart(clt, d->xid()))
+    ret = lock_protocol::OK;
+  log_sync();
+  d->reply(ret, 0);
+  send_grants(granted);
+}
+
+// takes the batch's locks one at a time in sorted order, parking on the
+// first one that is held; the release that grants it resumes the batch
+// from there. once all are held the client gets its single reply.
+void
+lock_server::continue_batch(batch *b)
+{
+  while (b->next < b->lids.size())
+  {
+    if (b->dropped)
+    {
+      end_batch(b, b->next, lock_protocol::RPCERR);
+      return;
+    }
+    lock_protocol::lockid_t lid = b->lids[b->next++];
+    waiter w(b);
+    lock_protocol::status ret = grant_or_park(lid, w);
+    if (ret == lock_protocol::RETRY)
+      return;
+    if (ret != lock_protocol::OK)
+    {
+      end_batch(b, b->next - 1, ret);
+      return;
+    }
+  }
+  if (b->dropped)
+  {
+    end_batch(b, b->next, lock_protocol::RPCERR);
+    return;
+  }
+  for (unsigned i = 0; lease_ms > 0 && i < b->lids.size(); i++)
+  {
+    record_ref ref(this, b->lids[i], false);
+    lock_record *rec = ref.rec;
+    slow_lock ml(rec);
+    holder *h = rec->find_holder(b->clt);
+    if (h && h->expires == 0)
+      start_lease(b->lids[i], *h);
+  }
+  log_sync();
+  b->d->reply(lock_protocol::OK, 0);
+  forget_batch(b);
+}
+
+// gives back the first held locks of b, which failed with ret. those
+// that drop_client already released are simply not found.
+void
+lock_server::end_batch(batch *b, unsigned held, lock_protocol::status ret)
+{
+  std::vector<waiter> granted;
+  for (unsigned i = 0; i < held; i++)
+    release_one(b->lids[i], b->clt, granted, b->owner);
+  log_sync();
+  b->d->reply(ret, 0);
+  send_grants(granted);
+  for (unsigned i = 0; i < held; i++)
+    notify_watchers(b->lids[i]);
+  forget_batch(b);
+}
+
+void
+lock_server::forget_batch(batch *b)
+{
+  {
+    ScopedLock bl(&batches_m);
+    batches.erase(b);
+  }
+  delete b;
+}
+
+// acquires every lock in lids exclusively and replies once all are
+// held. the locks are taken in ascending order, so two batches that
+// overlap cannot each end up holding a lock the other waits for.
+void
+lock_server::acquire_many(int clt, std::vector<lock_protocol::lockid_t> lids,
+                          unsigned int owner, deferred_reply *d)
+{
+  for (unsigned i = 0; i < lids.size(); i++)
+  {
+    if (!mine(lids[i]))
+    {
+      d->reply(lock_protocol::RPCERR, 0);
+      return;
+    }
+  }
+  batch *b = new batch();
+  b->lids.swap(lids);
+  std::sort(b->lids.begin(), b->lids.end());
+  b->lids.erase(std::unique(b->lids.begin(), b->lids.end()), b->lids.end());
+  b->next = 0;
+  b->clt = clt;
+  b->owner = owner;
+  b->d = d;
+  b->dropped = false;
+  {
+    ScopedLock bl(&batches_m);
+    batches.insert(b);
+  }
+  continue_batch(b);
+}
+
+void
+lock_server::release_many(int clt, std::vector<lock_protocol::lockid_t> lids,
+                          unsigned int owner, deferred_reply *d)
+{
+  std::vector<waiter> granted;
+  lock_protocol::status ret = lock_protocol::OK;
+
+  std::sort(lids.begin(), lids.end());
+  lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+  for (unsigned i = 0; i < lids.size(); i++)
+  {
+    if (release_one(lids[i], clt, granted, owner, d->xid()) !=
+        lock_protocol::OK)
+      ret = lock_protocol::RPCERR;
+  }
+  if (ret != lock_protocol::OK && done_before_restart(clt, d->xid()))
+    ret = lock_protocol::OK;
+  log_sync();
+  d->reply(ret, 0);
+  send_grants(granted);
+  for (unsigned i = 0; i < lids.size(); i++)
+    notify_watchers(lids[i]);
+}
+
+// extends the caller's leases on lid. NOENT means the caller does not
+// hold lid (any more): its lease ran out and the lock may have been
+// granted to someone else.
 lock_protocol::status
-lock_server::acquire(int clt, lock_protocol::lockid_t lid, int &r)
+lock_server::renew(int clt, lock_protocol::lockid_t lid, int &r)
+{
+  record_ref ref(this, lid, false);
+  lock_record *rec = ref.rec;
+  if (rec == NULL)
+    return lock_protocol::NOENT;
+
+  slow_lock ml(rec);
+  lock_protocol::status ret = lock_protocol::NOENT;
+  for (unsigned i = 0; i < rec->holders.size(); i++)
+  {
+    holder &h = rec->holders[i];
+    if (h.clt != clt)
+      continue;
+    // the wheel entry for the old expiry notices the new one when it
+    // comes due and reschedules itself
+    if (lease_ms > 0 && h.expires != 0)
+      h.expires = now_ms() + lease_ms;
+    ret = lock_protocol::OK;
+  }
+  return ret;
+}
+
+// starts (or restarts) h's lease. caller holds the lock record's mutex.
+void
+lock_server::start_lease(lock_protocol::lockid_t lid, holder &h)
+{
+  if (lease_ms <= 0)
+    return;
+  h.expires = now_ms() + lease_ms;
+  // an entry already on the wheel is due no later than the new expiry,
+  // and moves itself on from there
+  if (h.lease == 0)
+    schedule_lease(lid, h);
+}
+
+void
+lock_server::schedule_lease(lock_protocol::lockid_t lid, holder &h)
+{
+  ScopedLock tl(&timer_m);
+  if (h.lease == 0)
+    h.lease = next_timer_id++;
+  timers.add(timer_key(lid, h.clt, h.lease, true),
+             (h.expires + timer_tick_ms - 1) / timer_tick_ms);
+}
+
+// the wheel entry of lease id, clt's on lid, came due. if its holder
+// renewed meanwhile the entry goes back on the wheel; if it is blocked
+// in an upgrade the entry is dropped, and start_lease adds a new one
+// later; otherwise the holder loses the lock.
+void
+lock_server::expire_lease(lock_protocol::lockid_t lid, int clt,
+                          unsigned long long id)
+{
+  record_ref ref(this, lid, false);
+  lock_record *rec = ref.rec;
+  if (rec == NULL)
+    return;
+
+  std::vector<waiter> granted;
+  {
+    slow_lock ml(rec);
+    unsigned i = 0;
+    while (i < rec->holders.size() &&
+           (rec->holders[i].clt != clt || rec->holders[i].lease != id))
+      i++;
+    // released, or expired through another entry
+    if (i == rec->holders.size())
+      return;
+    holder &h = rec->holders[i];
+    if (h.expires == 0)
+    {
+      h.lease = 0;
+      return;
+    }
+    if (h.expires > now_ms())
+    {
+      schedule_lease(lid, h);
+      return;
+    }
+    rec->drop_holder(i, now_us());
+    rec->held = false;
+    log_op(lock_log::RELEASE, lid, rec, clt, 0);
+    grant_waiters(lid, rec, granted);
+  }
+  send_grants(granted);
+  notify_watchers(lid);
+}
+
+// a waiter that gave itself until now to get the lock; if it is still
+// queued it is dropped and told RETRY
+void
+lock_server::expire_waiter(lock_protocol::lockid_t lid, unsigned long long id)
+{
+  record_ref ref(this, lid, false);
+  lock_record *rec = ref.rec;
+  if (rec == NULL)
+    return;
+
+  std::vector<waiter> granted;
+  deferred_reply *d = NULL;
+  {
+    slow_lock ml(rec);
+    std::list<waiter>::iterator it;
+    for (it = rec->waiters.begin(); it != rec->waiters.end(); it++)
+    {
+      if (it->id == id)
+      {
+        d = it->d;
+        bump(rec->wait_us, now_us() - it->since);
+        wfg_unpark(lid, it->clt, it->owner);
+        rec->waiters.erase(it);
+        rec->nwaiters.store(rec->waiters.size(), std::memory_order_relaxed);
+        // readers queued behind a departing writer may get in now
+        grant_waiters(lid, rec, granted);
+        break;
+      }
+    }
+  }
+  if (d)
+    d->reply(lock_protocol::RETRY, 0);
+  send_grants(granted);
+}
+
+void
+lock_server::client_lost(unsigned int clt)
+{
+  if (grace_ms <= 0)
+    return;
+  ScopedLock ll(&lost_m);
+  lost[(int)clt] = now_ms() + grace_ms;
+}
+
+void
+lock_server::client_back(unsigned int clt)
+{
+  ScopedLock ll(&lost_m);
+  lost.erase((int)clt);
+}
+
+// clt's connection stayed dead for the whole grace period. it loses
+// every lock it holds, and its queued requests are answered RPCERR.
+// nothing indexes locks by client, so this looks at every lock in use;
+// it only happens when a client goes away without releasing.
+void
+lock_server::drop_client(int clt)
+{
+  // a batch that is running, rather than parked, is not found below;
+  // marked, it stops and gives back its locks by itself
+  {
+    ScopedLock bl(&batches_m);
+    std::set<batch *>::iterator it;
+    for (it = batches.begin(); it != batches.end(); it++)
+      if ((*it)->clt == clt)
+        (*it)->dropped = true;
+  }
+
+  // its watches go with it, so it is not told about the locks it loses
+  watch_drop_client(clt);
+
+  std::vector<lock_protocol::lockid_t> busy;
+  for (unsigned i = 0; i < nshards; i++)
+  {
+    lock_shard &s = shards[i];
+    ScopedLock sl(&s.m);
+    std::unordered_map<lock_protocol::lockid_t, lock_record>::iterator it;
+    for (it = s.records.begin(); it != s.records.end(); it++)
+      if (it->second.state != lock_record::FREE)
+        busy.push_back(it->first);
+  }
+
+  unsigned int released = 0;
+  for (unsigned i = 0; i < busy.size(); i++)
+  {
+    record_ref ref(this, busy[i], false);
+    lock_record *rec = ref.rec;
+    if (rec == NULL)
+      continue;
+    std::vector<waiter> granted, dropped;
+    deferred_reply *upgrader = NULL;
+    {
+      // also turns a fast holder into an entry of holders
+      slow_lock ml(rec);
+      unsigned long long now = now_us();
+      for (unsigned j = 0; j < rec->holders.size();)
+      {
+        if (rec->holders[j].clt != clt)
+        {
+          j++;
+          continue;
+        }
+        rec->drop_holder(j, now);
+        log_op(lock_log::RELEASE, busy[i], rec, clt, 0);
+        released++;
+      }
+      if (rec->holders.empty())
+        rec->held = false;
+      std::list<waiter>::iterator it;
+      for (it = rec->waiters.begin(); it != rec->waiters.end();)
+      {
+        if (it->clt != clt)
+        {
+          it++;
+          continue;
+        }
+        bump(rec->wait_us, now - it->since);
+        wfg_unpark(busy[i], clt, it->owner);
+        dropped.push_back(*it);
+        it = rec->waiters.erase(it);
+      }
+      rec->nwaiters.store(rec->waiters.size(), std::memory_order_relaxed);
+      if (rec->upgrader && rec->upgrader_clt == clt)
+      {
+        upgrader = rec->upgrader;
+        rec->upgrader = NULL;
+        wfg_unpark(busy[i], clt, rec->upgrader_owner);
+      }
+      grant_waiters(busy[i], rec, granted);
+    }
+    for (unsigned j = 0; j < dropped.size(); j++)
+    {
+      if (dropped[j].b)
+      {
+        dropped[j].b->d->reply(lock_protocol::RPCERR, 0);
+        forget_batch(dropped[j].b);
+      }
+      else
+        dropped[j].d->reply(lock_protocol::RPCERR, 0);
+    }
+    if (upgrader)
+      upgrader->reply(lock_protocol::RPCERR, 0);
+    send_grants(granted);
+    notify_watchers(busy[i]);
+  }
+  printf("lock_server: clt %u went away, released %u locks it held\n",
+         (unsigned)clt, released);
+  sem_drop_client(clt);
+  ScopedLock sl(&subscribers_m);
+  std::unordered_map<int, subscriber *>::iterator it = subscribers.find(clt);
+  if (it != subscribers.end())
+  {
+    retired.push_back(it->second);
+    subscribers.erase(it);
+  }
+}
+
+// called before clt's thread owner parks on lid, with rec->m held.
+// returns false if it would then wait for itself through other threads.
+bool
+lock_server::wfg_park(lock_protocol::lockid_t lid, lock_record *rec, int clt,
+                      unsigned int owner)
 {
-  pthread_mutex_lock(&lock_state_lock);
-  if (lock_state.count(lid) == 0)
+  ScopedLock gl(&wfg_m);
+  wfg_set_owners(lid, rec);
+  if (owner == 0)
+    return true;
+  if (wfg_cycle(node(clt, owner), lid))
   {
-    // printf("[lock_server][%d]New lock found: %llu\n", clt, lid);
-    pthread_mutex_t mutex;
-    pthread_mutex_init(&mutex, NULL);
-    lock_mutex.insert({lid, mutex});
+    if (rec->waiters.empty() && !rec->upgrader)
+    {
+      wfg_owners.erase(lid);
+      rec->in_wfg = false;
+    }
+    return false;
+  }
+  wfg_waits[node(clt, owner)][lid]++;
+  return true;
+}
 
-    pthread_cond_t cv;
-    pthread_cond_init(&cv, NULL);
-    lock_cv.insert({lid, cv});
+// clt's thread owner no longer waits for lid: it got it, gave up, or
+// went away
+void
+lock_server::wfg_unpark(lock_protocol::lockid_t lid, int clt,
+                        unsigned int owner)
+{
+  if (owner == 0)
+    return;
+  ScopedLock gl(&wfg_m);
+  std::unordered_map<wfg_node, std::map<lock_protocol::lockid_t,
+                                        unsigned int> >::iterator it =
+      wfg_waits.find(node(clt, owner));
+  if (it == wfg_waits.end() || it->second.count(lid) == 0)
+    return;
+  if (--it->second[lid] == 0)
+    it->second.erase(lid);
+  if (it->second.empty())
+    wfg_waits.erase(it);
+}
 
-    lock_state.insert({lid, false});
+// keeps lid's owners in the graph current after its holders or waiters
+// changed. caller holds rec->m.
+void
+lock_server::wfg_refresh(lock_protocol::lockid_t lid, lock_record *rec)
+{
+  bool waited = !rec->waiters.empty() || rec->upgrader;
+  if (!waited && !rec->in_wfg)
+    return;
+  ScopedLock gl(&wfg_m);
+  if (waited)
+    wfg_set_owners(lid, rec);
+  else
+  {
+    wfg_owners.erase(lid);
+    rec->in_wfg = false;
   }
-  pthread_mutex_unlock(&lock_state_lock);
+}
 
-  pthread_mutex_lock(&lock_mutex[lid]);
-  while (lock_state[lid] == true)
+// caller holds rec->m and wfg_m
+void
+lock_server::wfg_set_owners(lock_protocol::lockid_t lid, lock_record *rec)
+{
+  std::vector<wfg_node> &o = wfg_owners[lid];
+  o.clear();
+  for (unsigned i = 0; i < rec->holders.size(); i++)
+    if (rec->holders[i].owner != 0)
+      o.push_back(node(rec->holders[i].clt, rec->holders[i].owner));
+  rec->in_wfg = true;
+}
+
+// whether n is reachable from the holders of lid, i.e. whether n
+// waiting for lid would close a cycle. caller holds wfg_m.
+bool
+lock_server::wfg_cycle(wfg_node n, lock_protocol::lockid_t lid)
+{
+  std::vector<wfg_node> todo;
+  std::set<wfg_node> seen;
+  std::vector<wfg_node> &first = wfg_owners[lid];
+  for (unsigned i = 0; i < first.size(); i++)
+    if (first[i] != n)
+      todo.push_back(first[i]);
+  while (!todo.empty())
   {
-    // printf("[lock_server][%d]Lock %llu is held, waiting...\n", clt, lid);
-    pthread_cond_wait(&lock_cv[lid], &lock_mutex[lid]);
+    wfg_node c = todo.back();
+    todo.pop_back();
+    if (c == n)
+      return true;
+    if (!seen.insert(c).second)
+      continue;
+    std::unordered_map<wfg_node, std::map<lock_protocol::lockid_t,
+                                          unsigned int> >::iterator w =
+        wfg_waits.find(c);
+    if (w == wfg_waits.end())
+      continue;
+    std::map<lock_protocol::lockid_t, unsigned int>::iterator l;
+    for (l = w->second.begin(); l != w->second.end(); l++)
+    {
+      std::unordered_map<lock_protocol::lockid_t, std::vector<wfg_node> >::
+          iterator o = wfg_owners.find(l->first);
+      for (unsigned i = 0; o != wfg_owners.end() && i < o->second.size(); i++)
+        if (o->second[i] != c)
+          todo.push_back(o->second[i]);
+    }
   }
-  // printf("[lock_server][%d]Lock %llu is acquired\n", clt, lid);
-  lock_state[lid] = true;
-  pthread_mutex_unlock(&lock_mutex[lid]);
+  return false;
+}
+
+// notes a change of rec's holders in the log. caller holds rec->m.
+void
+lock_server::log_op(lock_log::op_t op, lock_protocol::lockid_t lid,
+                    lock_record *rec, int clt, unsigned int token,
+                    unsigned int xid)
+{
+  if (wal)
+    rec->lsn = wal->append(op, lid, clt, token, xid);
+}
+
+// whether the request xid from clt was handled before the server went
+// down: the client got no reply, and sends it again. xids of a client
+// only grow, and the restarted rpcs cannot tell on its own.
+bool
+lock_server::done_before_restart(int clt, unsigned int xid)
+{
+  lock_log::xid_map::iterator it = restored_xids.find(clt);
+  return it != restored_xids.end() && xid <= it->second;
+}
+
+// waits until the changes logged so far are on disk. called before a
+// change is acknowledged, never under a record's mutex.
+void
+lock_server::log_sync()
+{
+  if (wal)
+    wal->sync();
+}
+
+void
+lock_server::set_nonce(unsigned int n)
+{
+  if (!wal || n == nonce)
+    return;
+  nonce = n;
+  wal->append(lock_log::NONCE, 0, 0, n);
+  wal->sync();
+}
+
+// reloads the locks that were held when the server stopped, and the
+// semaphores. every holder starts out lost, as if its connection had
+// just died: one that does not show up within the grace period loses
+// its locks and units.
+void
+lock_server::restore()
+{
+  lock_log::state_map locks;
+  lock_log::sem_map lsems;
+  unsigned int max_token;
+  wal->recover(locks, lsems, max_token, nonce, restored_xids);
+  // locks without a record start above any token granted before
+  token_floor = max_token;
+  lock_log::state_map::iterator it;
+  for (it = locks.begin(); it != locks.end(); it++)
+  {
+    record_ref ref(this, it->first, true);
+    lock_record *rec = ref.rec;
+    slow_lock ml(rec);
+    rec->token = it->second.token;
+    rec->lsn = it->second.lsn;
+    for (unsigned i = 0; i < it->second.holders.size(); i++)
+    {
+      const lock_log::hold &hd = it->second.holders[i];
+      rec->holders.push_back(holder(hd.clt, 0, 0));
+      rec->holders.back().since = now_us();
+      rec->holders.back().xid = hd.xid;
+      rec->holders.back().restored = true;
+      if (hd.exclusive)
+        rec->held = true;
+      start_lease(it->first, rec->holders.back());
+      client_lost(hd.clt);
+    }
+  }
+  lock_log::sem_map::iterator si;
+  for (si = lsems.begin(); si != lsems.end(); si++)
+  {
+    std::map<int, unsigned int>::iterator h;
+    {
+      ScopedLock sl(&sems_m);
+      semaphore &s = sems[si->first];
+      s.capacity = si->second.capacity;
+      s.lsn = si->second.lsn;
+      s.held = si->second.held;
+      s.xids = si->second.xids;
+      for (h = s.held.begin(); h != s.held.end(); h++)
+        s.in_use += h->second;
+    }
+    for (h = si->second.held.begin(); h != si->second.held.end(); h++)
+      client_lost(h->first);
+  }
+  printf("lock_server: restored %u held locks, %u semaphores, nonce %u\n",
+         (unsigned)locks.size(), (unsigned)lsems.size(), nonce);
+  // so that the next restart does not replay this log again
+  checkpoint();
+}
+
+// replaces the log so far with a snapshot of the locks held and the
+// semaphores. requests
+// keep being served meanwhile: their log entries go to the new segment,
+// and each lock's snapshot carries the lsn of its last entry, so replay
+// can tell which entries it already reflects.
+void
+lock_server::checkpoint()
+{
+  unsigned long long gen = wal->rotate();
+  std::vector<lock_protocol::lockid_t> busy;
+  unsigned int max_token = token_floor;
+  for (unsigned i = 0; i < nshards; i++)
+  {
+    lock_shard &s = shards[i];
+    ScopedLock sl(&s.m);
+    std::unordered_map<lock_protocol::lockid_t, lock_record>::iterator it;
+    for (it = s.records.begin(); it != s.records.end(); it++)
+    {
+      if (it->second.token > max_token)
+        max_token = it->second.token;
+      if (it->second.state != lock_record::FREE)
+        busy.push_back(it->first);
+    }
+  }
+
+  std::vector<std::pair<lock_protocol::lockid_t, lock_log::lock_state> > locks;
+  for (unsigned i = 0; i < busy.size(); i++)
+  {
+    record_ref ref(this, busy[i], false);
+    lock_record *rec = ref.rec;
+    if (rec == NULL)
+      continue;
+    slow_lock ml(rec);
+    if (rec->holders.empty())
+      continue;
+    lock_log::lock_state s;
+    s.token = rec->token;
+    s.lsn = rec->lsn;
+    for (unsigned j = 0; j < rec->holders.size(); j++)
+      s.holders.push_back(lock_log::hold(rec->holders[j].clt, rec->held,
+                                         rec->holders[j].xid));
+    locks.push_back(std::make_pair(busy[i], s));
+  }
+
+  std::vector<std::pair<lock_protocol::lockid_t, lock_log::sem_state> > ss;
+  {
+    ScopedLock sl(&sems_m);
+    std::unordered_map<lock_protocol::lockid_t, semaphore>::iterator it;
+    for (it = sems.begin(); it != sems.end(); it++)
+    {
+      lock_log::sem_state s;
+      s.capacity = it->second.capacity;
+      s.lsn = it->second.lsn;
+      s.held = it->second.held;
+      s.xids = it->second.xids;
+      ss.push_back(std::make_pair(it->first, s));
+    }
+  }
+  wal->snapshot(gen, locks, ss, max_token, nonce);
+}
+
+// frees records that have been unused since the previous sweep. a lock
+// that is busy keeps its record (and, with it, its history); one that
+// stays idle costs nothing once it is gone.
+void
+lock_server::sweep()
+{
+  for (unsigned i = 0; i < nshards; i++)
+  {
+    lock_shard &s = shards[i];
+    ScopedLock sl(&s.m);
+    std::unordered_map<lock_protocol::lockid_t, lock_record>::iterator it;
+    for (it = s.records.begin(); it != s.records.end();)
+    {
+      // with no pins, nobody else is using the record. FREE means no
+      // fast holder and nothing in holders, waiters or upgrader.
+      lock_record &rec = it->second;
+      if (rec.refs == 0 && rec.state == lock_record::FREE)
+      {
+        if (rec.idle)
+        {
+          // out of the index, so no new reader finds it; a reader that
+          // found it before may pin it until the slot goes quiet. if it
+          // stays busy, the record stays out of the index for now.
+          index_slot &is = s.index[index_of(it->first)];
+          lock_record *p = &rec;
+          is.rec.compare_exchange_strong(p, NULL);
+          if (is.quiet() && rec.refs == 0)
+          {
+            raise_to(token_floor, rec.token.load());
+            it = s.records.erase(it);
+            s.reclaimed++;
+            continue;
+          }
+        }
+        else
+          rec.idle = true;
+      }
+      it++;
+    }
+  }
+}
+
+void
+lock_server::timer_loop()
+{
+  unsigned int ticks = 0;
+  while (!stopping)
+  {
+    std::vector<timer_key> due;
+    usleep(timer_tick_ms * 1000);
+    if (++ticks % (sweep_ms / timer_tick_ms) == 0)
+    {
+      sweep();
+      reap_subscribers();
+      if (wal && wal->segment_bytes() > checkpoint_bytes)
+        checkpoint();
+    }
+    {
+      ScopedLock tl(&timer_m);
+      timers.advance(now_ms() / timer_tick_ms, due);
+    }
+    for (unsigned i = 0; i < due.size(); i++)
+    {
+      if (due[i].lease)
+        expire_lease(due[i].lid, due[i].clt, due[i].id);
+      else
+        expire_waiter(due[i].lid, due[i].id);
+    }
+
+    std::vector<int> gone;
+    {
+      ScopedLock ll(&lost_m);
+      unsigned long long now = now_ms();
+      std::map<int, unsigned long long>::iterator it;
+      for (it = lost.begin(); it != lost.end();)
+      {
+        if (it->second > now)
+        {
+          it++;
+          continue;
+        }
+        gone.push_back(it->first);
+        lost.erase(it++);
+      }
+    }
+    for (unsigned i = 0; i < gone.size(); i++)
+      drop_client(gone[i]);
+  }
+}
+
+// like acquire, but gives up with RETRY if the lock cannot be had
+// within timeout_ms; with timeout_ms <= 0 it never waits at all.
+void
+lock_server::try_acquire(int clt, lock_protocol::lockid_t lid, int timeout_ms,
+                         unsigned int owner, deferred_reply *d)
+{
+  if (!mine(lid))
+  {
+    d->reply(lock_protocol::RPCERR, 0);
+    return;
+  }
+  waiter w(clt, owner, d, false);
+  if (timeout_ms <= 0)
+  {
+    if (grant_or_park(lid, w, false) == lock_protocol::OK)
+    {
+      log_sync();
+      d->reply(lock_protocol::OK, (int)w.token);
+    }
+    else
+      d->reply(lock_protocol::RETRY, 0);
+    return;
+  }
+
+  unsigned long long deadline = now_ms() + timeout_ms;
+  {
+    ScopedLock tl(&timer_m);
+    w.id = next_timer_id++;
+  }
+  lock_protocol::status ret = grant_or_park(lid, w);
+  if (ret != lock_protocol::RETRY)
+  {
+    if (ret == lock_protocol::OK)
+      log_sync();
+    d->reply(ret, ret == lock_protocol::OK ? (int)w.token : 0);
+    return;
+  }
+  // if w is granted before its deadline the entry finds nothing to drop
+  ScopedLock tl(&timer_m);
+  timers.add(timer_key(lid, clt, w.id, false),
+             (deadline + timer_tick_ms - 1) / timer_tick_ms);
+}
+
+// whether nobody holds lid right now
+bool
+lock_server::lock_free(lock_protocol::lockid_t lid)
+{
+  record_ref ref(this, lid, false, false);
+  lock_record *rec = ref.rec;
+  if (rec == NULL)
+    return true;
+  unsigned long long s = rec->state.load();
+  if (s != lock_record::SLOW)
+    return s == lock_record::FREE;
+  ScopedLock ml(&rec->m);
+  // the record may have gone back to the fast path meanwhile
+  return rec->holders.empty() && rec->state.load() <= lock_record::SLOW;
+}
+
+// asks to be notified (see rlock_protocol::notify) the next time lid
+// is released, by a release or because its holder went away. r is 1
+// if lid is free already; then no notification will come, unless a
+// release raced with this call. the caller must be subscribed.
+lock_protocol::status
+lock_server::watch(int clt, lock_protocol::lockid_t lid, int &r)
+{
+  r = 0;
+  if (!mine(lid))
+    return lock_protocol::RPCERR;
+  {
+    ScopedLock sl(&subscribers_m);
+    if (subscribers.count(clt) == 0)
+      return lock_protocol::RPCERR;
+  }
+  {
+    ScopedLock wl(&watches_m);
+    std::vector<int> &w = watches[lid];
+    if (w.empty())
+      nwatched++;
+    if (std::find(w.begin(), w.end(), clt) == w.end())
+      w.push_back(clt);
+  }
+  // registered first, so a release that this check misses still
+  // finds the watch
+  if (!lock_free(lid))
+    return lock_protocol::OK;
+  r = 1;
+  ScopedLock wl(&watches_m);
+  std::unordered_map<lock_protocol::lockid_t, std::vector<int> >::iterator it =
+      watches.find(lid);
+  if (it == watches.end())
+    return lock_protocol::OK;
+  std::vector<int>::iterator c =
+      std::find(it->second.begin(), it->second.end(), clt);
+  if (c != it->second.end())
+    it->second.erase(c);
+  if (it->second.empty())
+  {
+    watches.erase(it);
+    nwatched--;
+  }
+  return lock_protocol::OK;
+}
+
+// lid lost a holder: queues notifications for the clients watching
+// it, and drops their watches. like revoke, this must not be called
+// with rec->m held.
+void
+lock_server::notify_watchers(lock_protocol::lockid_t lid)
+{
+  if (nwatched.load() == 0)
+    return;
+  std::vector<int> clts;
+  {
+    ScopedLock wl(&watches_m);
+    std::unordered_map<lock_protocol::lockid_t, std::vector<int> >::iterator
+        it = watches.find(lid);
+    if (it == watches.end())
+      return;
+    clts.swap(it->second);
+    watches.erase(it);
+    nwatched--;
+  }
+  // a waiter may have been granted lid already
+  int free = lock_free(lid);
+  unsigned long long now = now_ms();
+  for (unsigned i = 0; i < clts.size(); i++)
+    queue_callback(callback(clts[i], lid, now, free));
+}
+
+// the watch half of drop_client: clt's watches go away with it
+void
+lock_server::watch_drop_client(int clt)
+{
+  if (nwatched.load() == 0)
+    return;
+  ScopedLock wl(&watches_m);
+  std::unordered_map<lock_protocol::lockid_t, std::vector<int> >::iterator it;
+  for (it = watches.begin(); it != watches.end();)
+  {
+    std::vector<int>::iterator c =
+        std::find(it->second.begin(), it->second.end(), clt);
+    if (c != it->second.end())
+      it->second.erase(c);
+    if (it->second.empty())
+    {
+      it = watches.erase(it);
+      nwatched--;
+    }
+    else
+      it++;
+  }
+}
+
+// creates semaphore sid with room for capacity units, or gives an
+// existing one a new capacity. units already held are kept; below the
+// new capacity acquirers wait until enough of them are released.
+lock_protocol::status
+lock_server::sem_init(int clt, lock_protocol::lockid_t sid,
+                      unsigned int capacity, int &r)
+{
+  r = 0;
+  if (!mine(sid) || capacity == 0)
+    return lock_protocol::RPCERR;
+  std::vector<sem_waiter> granted, dropped;
+  {
+    ScopedLock sl(&sems_m);
+    semaphore &s = sems[sid];
+    s.capacity = capacity;
+    sem_log(lock_log::SEM_INIT, sid, s, clt, capacity, 0);
+    // requests that can no longer ever fit
+    std::list<sem_waiter>::iterator it;
+    for (it = s.waiters.begin(); it != s.waiters.end();)
+    {
+      if (it->n <= capacity)
+      {
+        it++;
+        continue;
+      }
+      dropped.push_back(*it);
+      it = s.waiters.erase(it);
+    }
+    sem_grant(sid, s, granted);
+  }
+  log_sync();
+  for (unsigned i = 0; i < dropped.size(); i++)
+    dropped[i].d->reply(lock_protocol::RPCERR, 0);
+  for (unsigned i = 0; i < granted.size(); i++)
+    granted[i].d->reply(lock_protocol::OK, 0);
   return lock_protocol::OK;
 }
+
+// hands out units to the waiters at the head of s's queue for as long
+// as they fit. caller holds sems_m.
+void
+lock_server::sem_grant(lock_protocol::lockid_t sid, semaphore &s,
+                       std::vector<sem_waiter> &granted)
+{
+  while (!s.waiters.empty() &&
+         s.in_use + s.waiters.front().n <= s.capacity)
+  {
+    sem_waiter &w = s.waiters.front();
+    s.in_use += w.n;
+    s.held[w.clt] += w.n;
+    s.xids[w.clt] = w.xid;
+    sem_log(lock_log::SEM_GRANT, sid, s, w.clt, w.n, w.xid);
+    granted.push_back(w);
+    s.waiters.pop_front();
+  }
+}
+
+// notes a change of semaphore sid in the log. caller holds sems_m.
+void
+lock_server::sem_log(lock_log::op_t op, lock_protocol::lockid_t sid,
+                     semaphore &s, int clt, unsigned int n, unsigned int xid)
+{
+  if (wal)
+    s.lsn = wal->append(op, sid, clt, n, xid);
+}
+
+// takes n units of sid, parking behind earlier requests if they do not
+// all fit right now. NOENT if there is no such semaphore, RPCERR if n
+// is more than it could ever hold. a request that got its units before
+// a restart, sent again, is answered without taking more.
+void
+lock_server::sem_acquire(int clt, lock_protocol::lockid_t sid,
+                         unsigned int n, deferred_reply *d)
+{
+  lock_protocol::status ret;
+  {
+    ScopedLock sl(&sems_m);
+    std::unordered_map<lock_protocol::lockid_t, semaphore>::iterator it =
+        sems.find(sid);
+    if (!mine(sid) || n == 0)
+      ret = lock_protocol::RPCERR;
+    else if (it == sems.end())
+      ret = lock_protocol::NOENT;
+    else if (n > it->second.capacity)
+      ret = lock_protocol::RPCERR;
+    else if (done_before_restart(clt, d->xid()) &&
+             it->second.xids.count(clt) &&
+             it->second.xids[clt] == d->xid())
+      ret = lock_protocol::OK;
+    else
+    {
+      semaphore &s = it->second;
+      if (!s.waiters.empty() || s.in_use + n > s.capacity)
+      {
+        s.waiters.push_back(sem_waiter(clt, n, d));
+        return;
+      }
+      s.in_use += n;
+      s.held[clt] += n;
+      s.xids[clt] = d->xid();
+      sem_log(lock_log::SEM_GRANT, sid, s, clt, n, d->xid());
+      ret = lock_protocol::OK;
+    }
+  }
+  log_sync();
+  d->reply(ret, 0);
+}
+
+// like release, a release of units the client does not hold may be
+// one it sends again after a restart.
+void
+lock_server::sem_release(int clt, lock_protocol::lockid_t sid,
+                         unsigned int n, deferred_reply *d)
+{
+  lock_protocol::status ret = lock_protocol::OK;
+  std::vector<sem_waiter> granted;
+  {
+    ScopedLock sl(&sems_m);
+    std::unordered_map<lock_protocol::lockid_t, semaphore>::iterator it =
+        sems.find(sid);
+    if (it == sems.end())
+      ret = lock_protocol::NOENT;
+    else
+    {
+      semaphore &s = it->second;
+      std::map<int, unsigned int>::iterator h = s.held.find(clt);
+      // more than the caller holds
+      if (n == 0 || h == s.held.end() || h->second < n)
+        ret = lock_protocol::RPCERR;
+      else
+      {
+        if ((h->second -= n) == 0)
+        {
+          s.held.erase(h);
+          s.xids.erase(clt);
+        }
+        s.in_use -= n;
+        sem_log(lock_log::SEM_RELEASE, sid, s, clt, n, d->xid());
+        sem_grant(sid, s, granted);
+      }
+    }
+  }
+  if (ret != lock_protocol::OK && done_before_restart(clt, d->xid()))
+    ret = lock_protocol::OK;
+  log_sync();
+  d->reply(ret, 0);
+  for (unsigned i = 0; i < granted.size(); i++)
+    granted[i].d->reply(lock_protocol::OK, 0);
+}
+
+// the semaphore half of drop_client: clt's units go back, and its
+// queued requests are answered RPCERR
+void
+lock_server::sem_drop_client(int clt)
+{
+  std::vector<sem_waiter> granted, dropped;
+  {
+    ScopedLock sl(&sems_m);
+    std::unordered_map<lock_protocol::lockid_t, semaphore>::iterator it;
+    for (it = sems.begin(); it != sems.end(); it++)
+    {
+      semaphore &s = it->second;
+      std::map<int, unsigned int>::iterator h = s.held.find(clt);
+      if (h != s.held.end())
+      {
+        s.in_use -= h->second;
+        sem_log(lock_log::SEM_RELEASE, it->first, s, clt, h->second, 0);
+        s.held.erase(h);
+        s.xids.erase(clt);
+      }
+      std::list<sem_waiter>::iterator w;
+      for (w = s.waiters.begin(); w != s.waiters.end();)
+      {
+        if (w->clt != clt)
+        {
+          w++;
+          continue;
+        }
+        dropped.push_back(*w);
+        w = s.waiters.erase(w);
+      }
+      sem_grant(it->first, s, granted);
+    }
+  }
+  log_sync();
+  for (unsigned i = 0; i < dropped.size(); i++)
+    dropped[i].d->reply(lock_protocol::RPCERR, 0);
+  for (unsigned i = 0; i < granted.size(); i++)
+    granted[i].d->reply(lock_protocol::OK, 0);
+}
@@ -5,27 +5,438 @@
 #define lock_server_h
 
 #include <string>
+#include <list>
+#include <map>
+#include <set>
+#include <atomic>
 #include <unordered_map>
+#include <vector>
 #include "lock_protocol.h"
 #include "lock_client.h"
 #include "rpc.h"
+#include "timer_wheel.h"
+#include "lock_log.h"
+#include "lock_ring.h"
 
-class lock_server
+class lock_server : public rpcs_watcher
 {
 
 protected:
-  int nacquire;
-  pthread_mutex_t lock_state_lock;
-  std::unordered_map<lock_protocol::lockid_t, pthread_mutex_t> lock_mutex;
-  std::unordered_map<lock_protocol::lockid_t, pthread_cond_t> lock_cv;
-  std::unordered_map<lock_protocol::lockid_t, bool> lock_state;
+  // an acquire_many working through its lock ids in sorted order
+  struct batch
+  {
+    std::vector<lock_protocol::lockid_t> lids;
+    unsigned int next; // index of the next lock id to take
+    int clt;
+    unsigned int owner; // see wfg_node
+    deferred_reply *d;
+    // its client went away: it must not take any more locks, and gives
+    // back those it has (see drop_client)
+    std::atomic<bool> dropped;
+  };
+
+  // an acquire parked until the lock can be granted. a granted waiter
+  // is answered through d, or resumes its batch b.
+  struct waiter
+  {
+    waiter(int xclt, unsigned int xowner, deferred_reply *xd, bool xshared)
+        : clt(xclt), token(0), d(xd), b(NULL), shared(xshared), revoke(false),
+          xid(xd->xid()), owner(xowner), id(0), since(0), lid(0) {}
+    waiter(batch *xb)
+        : clt(xb->clt), token(0), d(NULL), b(xb), shared(false), revoke(false),
+          xid(xb->d->xid()), owner(xb->owner), id(0), since(0), lid(0) {}
+    int clt;
+    unsigned int token; // fencing token of the grant, once granted
+    deferred_reply *d;
+    batch *b;
+    bool shared;
+    // granted with others still queued behind it, so a caching client
+    // must be asked to give the lock back (see revoke)
+    bool revoke;
+    unsigned int xid; // of the request
+    unsigned int owner; // the thread waiting, see wfg_node
+    unsigned long long id; // set if it gives up at a deadline
+    unsigned long long since; // when it was parked, in us
+    lock_protocol::lockid_t lid; // the lock it waits for
+  };
+
+  // a client holding a lock, and when its lease runs out. 0 means
+  // never: leases are off, or the holder is still blocked in a batch
+  // or upgrade and so cannot renew yet.
+  struct holder
+  {
+    holder(int xclt, unsigned int xowner, unsigned long long xexpires)
+        : clt(xclt), xid(0), expires(xexpires), since(0), lease(0),
+          owner(xowner), restored(false) {}
+    int clt;
+    unsigned int xid; // of the request that was granted the lock
+    unsigned long long expires;
+    unsigned long long since; // when it was granted, in us
+    unsigned long long lease; // id of its entry on the timer wheel, or 0
+    unsigned int owner; // the thread that asked for it, see wfg_node
+    // from the log, and not heard from since the restart: a request
+    // with xid is the client sending the granted one again
+    bool restored;
+  };
+
+  // everything acquire/release need to know about one lock id. there
+  // is one per lock id in use, so keep it small: the members are ordered
+  // to avoid padding, and an empty waiter list allocates nothing.
+  //
+  // an uncontended exclusive lock lives entirely in state: acquire and
+  // release just swap it between FREE and held_by(clt, owner) without
+  // taking m.
+  // everything else takes m and first moves the lock into the holders
+  // vector and sets state to SLOW (see slow_lock), which makes the fast
+  // path back off until the record is unused again.
+  struct lock_record
+  {
+    enum { FREE = 0, SLOW = 1, FAST_HELD = 2 };
+    // owners fit in the 30 bits above the state (see lock_client::owner)
+    static unsigned long long held_by(int clt, unsigned int owner) {
+      return ((unsigned long long)(unsigned)clt << 32) | (owner << 2) |
+             FAST_HELD;
+    }
+
+    lock_record();
+    ~lock_record();
+    pthread_mutex_t m;
+    // the exclusive holder, or one entry per shared hold
+    std::vector<holder> holders;
+    // acquires parked until the lock is released, oldest first; their
+    // dispatch threads went back to the pool
+    std::list<waiter> waiters;
+    // a shared holder waiting for the other readers to leave
+    deferred_reply *upgrader;
+    int upgrader_clt;
+    unsigned int upgrader_owner;
+    // contention counters, see lock_protocol::lock_stats. they are only
+    // written under m, but stat readers load them without it.
+    std::atomic<unsigned long long> acquires;
+    std::atomic<unsigned long long> waits;
+    std::atomic<unsigned long long> wait_us;
+    std::atomic<unsigned long long> max_hold_us;
+    std::atomic<unsigned int> nwaiters;
+    // the fencing token of the latest grant; every grant gets the next
+    std::atomic<unsigned int> token;
+    std::atomic<unsigned long long> state;
+    std::atomic<unsigned long long> fast_since; // when the fast hold began
+    // threads between get_record() and done with the record; the sweeper
+    // only frees records nobody has pinned
+    std::atomic<int> refs;
+    lock_protocol::lockid_t lid;
+    bool held; // held exclusively by holders[0]
+    std::atomic<bool> idle; // found unused by the last sweep
+    unsigned long long lsn; // of the latest log entry about this lock
+    bool in_wfg; // has an entry in wfg_owners
+
+    int readers() { return held ? 0 : holders.size(); }
+    holder *find_holder(int clt, unsigned int owner = 0);
+    bool unused() { return holders.empty() && waiters.empty() && !upgrader; }
+    void drop_holder(unsigned i, unsigned long long now);
+    void read_stats(lock_protocol::lockid_t lid, lock_protocol::lock_stats &);
+    bool fast_acquire(int clt, unsigned int owner, unsigned int &token);
+    bool fast_release(int clt);
+  };
+
+  // rec->m, held with the lock off the fast path; on the way out an
+  // unused record is handed back to the fast path
+  struct slow_lock
+  {
+    slow_lock(lock_record *rec);
+    ~slow_lock();
+    lock_record *rec;
+  };
+
+  // pins the record for lid (see get_record) for as long as it is in scope
+  struct record_ref
+  {
+    record_ref(lock_server *ls, lock_protocol::lockid_t lid, bool create,
+               bool use = true)
+        : rec(ls->get_record(lid, create, use)) {}
+    ~record_ref() { if (rec) rec->refs--; }
+    lock_record *rec;
+  };
+
+  // the lock table is split into shards with a mutex each, so requests
+  // for unrelated locks do not serialize behind one table-wide mutex.
+  // records live in the map nodes, which never move.
+  //
+  // in front of the map is an index that get_record reads without the
+  // mutex. a slot points at one of the records whose ids hash to it, or
+  // is NULL, and counts the readers looking through it. the map and the
+  // slots only change under the mutex; sweep() takes a record out of
+  // its slot, then frees it only once the slot has had no readers, as
+  // none of those that may still have seen it can be left then.
+  struct index_slot
+  {
+    index_slot() : rec(NULL), readers(0) {}
+    std::atomic<lock_record *> rec;
+    std::atomic<int> readers;
+    bool quiet();
+  };
+  struct lock_shard
+  {
+    enum { INDEX_SLOTS = 256 };
+    lock_shard();
+    ~lock_shard();
+    pthread_mutex_t m;
+    std::unordered_map<lock_protocol::lockid_t, lock_record> records;
+    unsigned long long reclaimed; // records freed by sweep()
+    index_slot index[INDEX_SLOTS];
+  };
+
+  // something on the timer wheel that may be due: the lease of clt on
+  // lid with that id (see holder::lease), or the deadline of the waiter
+  // with that id
+  struct timer_key
+  {
+    timer_key(lock_protocol::lockid_t xlid, int xclt, unsigned long long xid,
+              bool xlease)
+        : lid(xlid), clt(xclt), id(xid), lease(xlease) {}
+    lock_protocol::lockid_t lid;
+    int clt;
+    unsigned long long id;
+    bool lease;
+  };
+
+  unsigned int nshards;
+  lock_shard *shards;
+  // at least the last token of every record sweep() has freed, so that
+  // a lock's tokens keep increasing when its record is created again
+  std::atomic<unsigned int> token_floor;
+
+  // leases: a holder that does not renew within lease_ms loses the
+  // lock. the wheel has one entry per granted lease, checked when it
+  // comes due; renewals just move holder::expires and get picked up
+  // then, so neither granting nor renewing searches anything. an entry
+  // whose holder is gone finds no holder with its id and is dropped.
+  // waiters with a deadline get an entry too.
+  int lease_ms; // 0: locks are held until released
+  pthread_mutex_t timer_m; // protects timers and next_timer_id
+  timer_wheel<timer_key> timers;
+  unsigned long long next_timer_id;
+  std::atomic<bool> stopping;
+  pthread_t timer_th;
+
+  // caching clients (see lock_client_cache) keep locks after releasing
+  // them locally; they are told to give a lock back when somebody waits
+  // for it. a client that goes away (see drop_client) is retired, and
+  // the timer thread deletes its rpcc once no call uses it any more.
+  struct subscriber
+  {
+    subscriber(rpcc *xcl) : cl(xcl), calls(0) {}
+    rpcc *cl;
+    unsigned int calls; // in flight on cl, under subscribers_m
+  };
+  pthread_mutex_t subscribers_m;
+  std::unordered_map<int, subscriber *> subscribers;
+  std::vector<subscriber *> retired;
+  subscriber *get_subscriber(int clt);
+  void put_subscriber(subscriber *s);
+  void reap_subscribers();
+
+  // revokes waiting to be sent. the callback thread sends them with
+  // call_async, so no dispatch or timer thread ever waits for a client.
+  // one that fails is queued again, to go out after callback_retry_ms,
+  // for as long as its client still holds the lock and somebody still
+  // waits for it. watch notifications go out the same way, but only
+  // once.
+  struct callback
+  {
+    callback(int xclt, lock_protocol::lockid_t xlid, unsigned long long xdue,
+             int xnotify = -1)
+        : clt(xclt), lid(xlid), due(xdue), notify(xnotify) {}
+    int clt;
+    lock_protocol::lockid_t lid;
+    unsigned long long due; // in ms
+    int notify; // -1: a revoke; else a notify, with whether lid was free
+  };
+  pthread_mutex_t callbacks_m;
+  pthread_cond_t callbacks_c;
+  std::list<callback> callbacks;
+  pthread_t callback_th;
+  void queue_callback(const callback &c);
+  void send_callback(const callback &c);
+  bool revoke_wanted(lock_protocol::lockid_t lid, int clt);
+  void callback_loop();
+
+  // clients whose connection died, and when their grace period ends.
+  // one that has not reconnected by then loses its locks and queued
+  // requests, so a crashed client does not block the others forever.
+  int grace_ms; // 0: locks are kept until released
+  pthread_mutex_t lost_m;
+  std::map<int, unsigned long long> lost;
+  // batches not yet answered, so that drop_client can stop those of its
+  // client that it does not find parked
+  pthread_mutex_t batches_m;
+  std::set<batch *> batches;
+
+  // with a log directory, every change of a lock's holders is logged
+  // under the record's mutex, and the log is synced before the change
+  // is acknowledged. a restarted server reloads the holders, and gives
+  // its rpcs the old nonce so that clients carry on without rebinding.
+  lock_log *wal; // NULL: no log
+  unsigned int nonce;
+  // what the log said about the clients' xids; set before serving, and
+  // read-only after
+  lock_log::xid_map restored_xids;
+  bool done_before_restart(int clt, unsigned int xid);
+
+  // this server is shard `shard' of a cluster of ring.size() servers,
+  // and only grants the locks the ring gives it. a lock granted by two
+  // servers of a misconfigured cluster would not be a lock at all.
+  lock_ring ring;
+  unsigned int shard;
+  bool mine(lock_protocol::lockid_t lid);
+
+  // wait-for graph: a thread waits for the threads that hold a lock it
+  // is queued for. it only covers locks that have waiters, so locks
+  // nobody waits for never touch wfg_m. a request that would close a
+  // cycle gets DEADLOCK instead of waiting. a node is a client's thread,
+  // as named by the owner id the client sends along (see
+  // lock_client::owner); owner 0 is a request nobody blocks on, or a
+  // hold whose thread is unknown, and never part of a cycle. a thread
+  // waiting for itself is not a cycle.
+  typedef unsigned long long wfg_node;
+  static wfg_node node(int clt, unsigned int owner) {
+    return ((unsigned long long)(unsigned)clt << 32) | owner;
+  }
+  pthread_mutex_t wfg_m; // after a record's mutex
+  // the locks each node is queued for (and how many times)
+  std::unordered_map<wfg_node, std::map<lock_protocol::lockid_t, unsigned int> >
+      wfg_waits;
+  // holders of the locks somebody is queued for
+  std::unordered_map<lock_protocol::lockid_t, std::vector<wfg_node> >
+      wfg_owners;
+  bool wfg_park(lock_protocol::lockid_t lid, lock_record *rec, int clt,
+                unsigned int owner);
+  void wfg_unpark(lock_protocol::lockid_t lid, int clt, unsigned int owner);
+  void wfg_refresh(lock_protocol::lockid_t lid, lock_record *rec);
+  void wfg_set_owners(lock_protocol::lockid_t lid, lock_record *rec);
+  bool wfg_cycle(wfg_node n, lock_protocol::lockid_t lid);
+
+  // counting semaphores, in an id space of their own. they are few and
+  // long-lived, so one mutex covers them all. their units are logged
+  // like grants, but are not leased.
+  struct sem_waiter
+  {
+    sem_waiter(int xclt, unsigned int xn, deferred_reply *xd)
+        : clt(xclt), n(xn), d(xd), xid(xd->xid()) {}
+    int clt;
+    unsigned int n;
+    deferred_reply *d;
+    unsigned int xid;
+  };
+  struct semaphore
+  {
+    semaphore() : capacity(0), in_use(0), lsn(0) {}
+    unsigned int capacity;
+    unsigned int in_use;
+    unsigned long long lsn; // of its latest log entry
+    std::map<int, unsigned int> held; // units by client
+    // of each holder's latest grant, to know it when it comes again
+    // after a restart
+    std::map<int, unsigned int> xids;
+    // strictly first come first served: a large request at the head
+    // holds back smaller ones that would fit, so it is not starved
+    std::list<sem_waiter> waiters;
+  };
+  pthread_mutex_t sems_m;
+  std::unordered_map<lock_protocol::lockid_t, semaphore> sems;
+  void sem_grant(lock_protocol::lockid_t sid, semaphore &s,
+                 std::vector<sem_waiter> &granted);
+  void sem_log(lock_log::op_t op, lock_protocol::lockid_t sid,
+               semaphore &s, int clt, unsigned int n, unsigned int xid);
+  void sem_drop_client(int clt);
+
+  // subscribed clients to notify when a lock is next released (see
+  // watch). a watch fires once. nwatched counts the locks with watches,
+  // so that releases only take watches_m while there are any.
+  pthread_mutex_t watches_m;
+  std::unordered_map<lock_protocol::lockid_t, std::vector<int> > watches;
+  std::atomic<unsigned int> nwatched;
+  bool lock_free(lock_protocol::lockid_t lid);
+  void notify_watchers(lock_protocol::lockid_t lid);
+  void watch_drop_client(int clt);
+
+  lock_shard &shard_of(lock_protocol::lockid_t lid);
+  static unsigned int index_of(lock_protocol::lockid_t lid);
+  lock_record *get_record(lock_protocol::lockid_t lid, bool create,
+                          bool use = true);
+  void take(lock_protocol::lockid_t lid, lock_record *rec, waiter &w);
+  void grant_waiters(lock_protocol::lockid_t lid, lock_record *rec,
+                     std::vector<waiter> &granted);
+  void send_grants(std::vector<waiter> &granted);
+  lock_protocol::status grant_or_park(lock_protocol::lockid_t lid, waiter &w,
+                                      bool park = true);
+  lock_protocol::status release_one(lock_protocol::lockid_t lid, int clt,
+                                    std::vector<waiter> &granted,
+                                    unsigned int owner = 0,
+                                    unsigned int xid = 0);
+  void continue_batch(batch *b);
+  void end_batch(batch *b, unsigned held, lock_protocol::status ret);
+  void forget_batch(batch *b);
+  void revoke(lock_protocol::lockid_t lid, const std::vector<int> &clts);
+  void start_lease(lock_protocol::lockid_t lid, holder &h);
+  void schedule_lease(lock_protocol::lockid_t lid, holder &h);
+  void expire_lease(lock_protocol::lockid_t lid, int clt,
+                    unsigned long long id);
+  void expire_waiter(lock_protocol::lockid_t lid, unsigned long long id);
+  void drop_client(int clt);
+  void log_op(lock_log::op_t op, lock_protocol::lockid_t lid,
+              lock_record *rec, int clt, unsigned int token,
+              unsigned int xid = 0);
+  void log_sync();
+  void restore();
+  void checkpoint();
+  void sweep();
+  void timer_loop();
 
 public:
-  lock_server();
-  ~lock_server(){};
+  lock_server(int lease_ms = 0, int grace_ms = 0,
+              const std::string &log_dir = "", unsigned int shard = 0,
+              unsigned int nservers = 1);
+  ~lock_server();
+  // the rpcs nonce found in the log, or 0; and the one actually in use
+  unsigned int logged_nonce() { return nonce; }
+  void set_nonce(unsigned int n);
+  // rpcs_watcher
+  void client_lost(unsigned int clt);
+  void client_back(unsigned int clt);
   lock_protocol::status stat(int clt, lock_protocol::lockid_t lid, int &);
-  lock_protocol::status acquire(int clt, lock_protocol::lockid_t lid, int &);
-  lock_protocol::status release(int clt, lock_protocol::lockid_t lid, int &);
+  lock_protocol::status subscribe(int clt, std::string dst, int &);
+  lock_protocol::status table_stat(int clt,
+                                   std::map<std::string, unsigned long long> &);
+  lock_protocol::status lock_stat(int clt, lock_protocol::lockid_t lid,
+                                  lock_protocol::lock_stats &);
+  lock_protocol::status top_locks(int clt, unsigned int n,
+                                  std::vector<lock_protocol::lock_stats> &);
+  // owner names the calling thread (see wfg_node); a release gives back
+  // the hold of that owner if there is one, or else any of clt's
+  void acquire(int clt, lock_protocol::lockid_t lid, unsigned int owner,
+               deferred_reply *);
+  void release(int clt, lock_protocol::lockid_t lid, unsigned int owner,
+               deferred_reply *);
+  void acquire_shared(int clt, lock_protocol::lockid_t lid,
+                      unsigned int owner, deferred_reply *);
+  void upgrade(int clt, lock_protocol::lockid_t lid, unsigned int owner,
+               deferred_reply *);
+  void downgrade(int clt, lock_protocol::lockid_t lid, deferred_reply *);
+  void acquire_many(int clt, std::vector<lock_protocol::lockid_t> lids,
+                    unsigned int owner, deferred_reply *);
+  void release_many(int clt, std::vector<lock_protocol::lockid_t> lids,
+                    unsigned int owner, deferred_reply *);
+  lock_protocol::status renew(int clt, lock_protocol::lockid_t lid, int &);
+  void try_acquire(int clt, lock_protocol::lockid_t lid, int timeout_ms,
+                   unsigned int owner, deferred_reply *);
+  lock_protocol::status watch(int clt, lock_protocol::lockid_t lid, int &);
+  lock_protocol::status sem_init(int clt, lock_protocol::lockid_t sid,
+                                 unsigned int capacity, int &);
+  void sem_acquire(int clt, lock_protocol::lockid_t sid, unsigned int n,
+                   deferred_reply *);
+  void sem_release(int clt, lock_protocol::lockid_t sid, unsigned int n,
+                   deferred_reply *);
 };
 
 #endif
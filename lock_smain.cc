@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "lock_server.h"
 
 #include "jsl_log.h"
@@ -16,19 +17,65 @@ main(int argc, char *argv[])
 
   srandom(getpid());
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  int lease_ms = 0;
+  int grace_ms = 0;
+  std::string log_dir;
+  unsigned int shard = 0, nservers = 1;
+  int ch;
+  while((ch = getopt(argc, argv, "l:g:d:s:")) != -1){
+    switch(ch){
+      case 'l':
+        lease_ms = atoi(optarg);
+        break;
+      case 'g':
+        grace_ms = atoi(optarg);
+        break;
+      case 'd':
+        log_dir = optarg;
+        break;
+      case 's':
+        // shard i of a cluster of n servers: -s i/n
+        if(sscanf(optarg, "%u/%u", &shard, &nservers) != 2 ||
+           shard >= nservers){
+          fprintf(stderr, "%s: bad shard %s\n", argv[0], optarg);
+          exit(1);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  if(argc - optind != 1){
+    fprintf(stderr, "Usage: %s [-l lease_ms] [-g grace_ms] [-d log_dir] [-s i/n] port\n", argv[0]);
     exit(1);
   }
 
   //jsl_set_debug(2);
 
 #ifndef RSM
-  lock_server ls;
-  rpcs server(atoi(argv[1]));
+  lock_server ls(lease_ms, grace_ms, log_dir, shard, nservers);
+  rpcs server(atoi(argv[optind]), 0, ls.logged_nonce());
+  ls.set_nonce(server.nonce());
+  server.set_watcher(&ls);
   server.reg(lock_protocol::stat, &ls, &lock_server::stat);
+  server.reg(lock_protocol::subscribe, &ls, &lock_server::subscribe);
   server.reg(lock_protocol::acquire, &ls, &lock_server::acquire);
   server.reg(lock_protocol::release, &ls, &lock_server::release);
+  server.reg(lock_protocol::acquire_shared, &ls, &lock_server::acquire_shared);
+  server.reg(lock_protocol::upgrade, &ls, &lock_server::upgrade);
+  server.reg(lock_protocol::downgrade, &ls, &lock_server::downgrade);
+  server.reg(lock_protocol::acquire_many, &ls, &lock_server::acquire_many);
+  server.reg(lock_protocol::release_many, &ls, &lock_server::release_many);
+  server.reg(lock_protocol::renew, &ls, &lock_server::renew);
+  server.reg(lock_protocol::try_acquire, &ls, &lock_server::try_acquire);
+  server.reg(lock_protocol::table_stat, &ls, &lock_server::table_stat);
+  server.reg(lock_protocol::lock_stat, &ls, &lock_server::lock_stat);
+  server.reg(lock_protocol::top_locks, &ls, &lock_server::top_locks);
+  server.reg(lock_protocol::watch, &ls, &lock_server::watch);
+  server.reg(lock_protocol::sem_init, &ls, &lock_server::sem_init);
+  server.reg(lock_protocol::sem_acquire, &ls, &lock_server::sem_acquire);
+  server.reg(lock_protocol::sem_release, &ls, &lock_server::sem_release);
 #endif
 
 
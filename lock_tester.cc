@@ -4,20 +4,25 @@
 
 #include "lock_protocol.h"
 #include "lock_client.h"
+#include "lock_client_cache.h"
 #include "rpc.h"
 #include "jsl_log.h"
 #include <arpa/inet.h>
 #include <vector>
+#include <sstream>
 #include <stdlib.h>
 #include <stdio.h>
 
 // must be >= 2
-int nt = 10; //XXX: lab1's rpc handlers are blocking. Since rpcs uses a thread pool of 10 threads, we cannot test more than 10 blocking rpc.
+int nt = 20; // more than the 10 rpcs dispatch threads: waiting acquires must not hold one
 std::string dst;
 lock_client **lc = new lock_client * [nt];
 lock_protocol::lockid_t a = 1;
 lock_protocol::lockid_t b = 2;
 lock_protocol::lockid_t c = 3;
+lock_protocol::lockid_t d = 4;
+lock_protocol::lockid_t e = 5;
+lock_protocol::lockid_t f = 6;
 
 // check_grant() and check_release() check that the lock server
 // doesn't grant the same lock to both clients.
@@ -143,6 +148,741 @@ test5(void *x)
   return 0;
 }
 
+int grant_order[256];
+int ngranted;
+
+void *
+test6(void *x)
+{
+  int i = * (int *) x;
+
+  // stagger the requests so they reach the server in client order
+  usleep(i * 50000);
+  lc[i]->acquire(b);
+  check_grant(b);
+  pthread_mutex_lock(&count_mutex);
+  grant_order[ngranted++] = i;
+  pthread_mutex_unlock(&count_mutex);
+  check_release(b);
+  lc[i]->release(b);
+  return 0;
+}
+
+int writer_in, reader_in;
+
+void *
+test7_writer(void *x)
+{
+  lc[2]->acquire(c);
+  pthread_mutex_lock(&count_mutex);
+  writer_in = 1;
+  pthread_mutex_unlock(&count_mutex);
+  usleep(300000);
+  lc[2]->downgrade(c);
+  return 0;
+}
+
+void *
+test7_reader(void *x)
+{
+  lc[3]->acquire_shared(c);
+  pthread_mutex_lock(&count_mutex);
+  reader_in = 1;
+  pthread_mutex_unlock(&count_mutex);
+  return 0;
+}
+
+void
+test7(void)
+{
+  pthread_t w, rd;
+
+  printf ("test7: shared holders exclude a writer, queued writer excludes new readers\n");
+  lc[0]->acquire_shared(c);
+  lc[1]->acquire_shared(c);
+  assert(pthread_create(&w, NULL, test7_writer, NULL) == 0);
+  usleep(300000);
+  assert(pthread_create(&rd, NULL, test7_reader, NULL) == 0);
+  usleep(300000);
+  pthread_mutex_lock(&count_mutex);
+  if (writer_in || reader_in) {
+    fprintf(stderr, "error: %s got %016llx while readers held it\n",
+            writer_in ? "writer" : "queued reader", c);
+    exit(1);
+  }
+  pthread_mutex_unlock(&count_mutex);
+  lc[0]->release(c);
+  lc[1]->release(c);
+
+  // the writer gets it first, then downgrades and shares it with the reader
+  pthread_join(w, NULL);
+  pthread_join(rd, NULL);
+  assert(writer_in && reader_in);
+  lc[2]->release(c);
+  lc[3]->release(c);
+
+  printf ("test7: sole reader upgrades and downgrades\n");
+  lc[0]->acquire_shared(c);
+  assert(lc[0]->upgrade(c) == lock_protocol::OK);
+  lc[0]->downgrade(c);
+  lc[1]->acquire_shared(c);
+  lc[0]->release(c);
+  lc[1]->release(c);
+}
+
+void *
+test8(void *x)
+{
+  int i = * (int *) x;
+  std::vector<lock_protocol::lockid_t> lids;
+
+  // overlapping sets, listed in different orders by different clients
+  if (i % 2) {
+    lids.push_back(c);
+    lids.push_back(a);
+  } else {
+    lids.push_back(a);
+    lids.push_back(b);
+    lids.push_back(c);
+  }
+  printf ("test8: client %d acquire_many/release_many concurrent\n", i);
+  for (int j = 0; j < 10; j++) {
+    lc[i]->acquire_many(lids);
+    for (unsigned k = 0; k < lids.size(); k++)
+      check_grant(lids[k]);
+    for (unsigned k = 0; k < lids.size(); k++)
+      check_release(lids[k]);
+    lc[i]->release_many(lids);
+  }
+  return 0;
+}
+
+void
+test10(void)
+{
+  struct timespec t0, t1;
+
+  printf ("test10: try_acquire gives up on a held lock, gets a free one\n");
+  lc[0]->acquire(a);
+  assert(lc[1]->try_acquire(a) == lock_protocol::RETRY);
+  clock_gettime(CLOCK_REALTIME, &t0);
+  assert(lc[1]->try_acquire(a, 300) == lock_protocol::RETRY);
+  clock_gettime(CLOCK_REALTIME, &t1);
+  int waited = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+  if (waited < 250 || waited > 2000) {
+    fprintf(stderr, "error: try_acquire with 300ms timeout took %dms\n", waited);
+    exit(1);
+  }
+  // the timed-out waiter must be gone: a release hands the lock to nobody
+  lc[0]->release(a);
+  assert(lc[1]->try_acquire(a) == lock_protocol::OK);
+  check_grant(a);
+  check_release(a);
+  lc[1]->release(a);
+
+  lc[0]->acquire(a);
+  assert(lc[1]->try_acquire(a, 0) == lock_protocol::RETRY);
+  lc[0]->release(a);
+  assert(lc[1]->try_acquire(a, 5000) == lock_protocol::OK);
+  lc[1]->release(a);
+}
+
+void
+test11(void)
+{
+  std::map<std::string, unsigned long long> before, after;
+
+  printf ("test11: records of locks nobody uses any more are freed\n");
+  for (int i = 0; i < 500; i++) {
+    lc[0]->acquire(1000000 + i);
+    lc[0]->release(1000000 + i);
+  }
+  lc[0]->table_stat(before);
+  // a record is freed by the second sweep that finds it idle
+  sleep(3);
+  lc[0]->table_stat(after);
+  printf ("test11: %llu records (%llu bytes), %llu after 3 seconds (%llu bytes)\n",
+          before["records"], before["record_bytes"],
+          after["records"], after["record_bytes"]);
+  if (before["records"] < 500 || after["records"] > before["records"] - 500 ||
+      after["reclaimed"] < before["reclaimed"] + 500) {
+    fprintf(stderr, "error: idle lock records were not freed\n");
+    exit(1);
+  }
+}
+
+void *
+test12_waiter(void *x)
+{
+  int i = * (int *) x;
+
+  lc[i]->acquire(d);
+  lc[i]->release(d);
+  return 0;
+}
+
+void
+test12(void)
+{
+  lock_protocol::lock_stats s;
+  std::vector<lock_protocol::lock_stats> top;
+  pthread_t th;
+  int one = 1;
+
+  printf ("test12: contention on a lock shows in its counters\n");
+  lc[0]->acquire(d);
+  assert(pthread_create(&th, NULL, test12_waiter, (void *) &one) == 0);
+  usleep(200000);
+  assert(lc[0]->lock_stat(d, s) == lock_protocol::OK);
+  if (s.waiters != 1) {
+    fprintf(stderr, "error: %u waiters on %016llx, expected 1\n", s.waiters, d);
+    exit(1);
+  }
+  lc[0]->release(d);
+  pthread_join(th, NULL);
+
+  assert(lc[0]->lock_stat(d, s) == lock_protocol::OK);
+  printf ("test12: acquires %llu waits %llu wait_us %llu max_hold_us %llu\n",
+          s.acquires, s.waits, s.wait_us, s.max_hold_us);
+  if (s.acquires < 2 || s.waits < 1 || s.waiters != 0 ||
+      s.wait_us < 150000 || s.max_hold_us < 150000) {
+    fprintf(stderr, "error: wrong counters for %016llx\n", d);
+    exit(1);
+  }
+  assert(lc[0]->stat(d) == (int) s.token);
+
+  lc[0]->top_locks(3, top);
+  assert(top.size() >= 1 && top.size() <= 3);
+  for (unsigned i = 1; i < top.size(); i++)
+    assert(top[i - 1].wait_us >= top[i].wait_us);
+  assert(top[0].wait_us >= s.wait_us);
+}
+
+lock_client_cache *lcc[3];
+
+void *
+test13_user(void *x)
+{
+  int i = * (int *) x;
+
+  for (int j = 0; j < 100; j++) {
+    lcc[i % 3]->acquire(e);
+    check_grant(e);
+    check_release(e);
+    lcc[i % 3]->release(e);
+  }
+  return 0;
+}
+
+void
+test13(void)
+{
+  printf ("test13: a caching client keeps a lock until it is revoked\n");
+  for (int i = 0; i < 3; i++)
+    lcc[i] = new lock_client_cache(dst);
+
+  // repeated local acquires never reach the server
+  int before = lc[0]->stat(f);
+  for (int j = 0; j < 1000; j++) {
+    lcc[0]->acquire(f);
+    lcc[0]->release(f);
+  }
+  if (lc[0]->stat(f) != before + 1) {
+    fprintf(stderr, "error: %d server acquires of %016llx for 1000 local ones\n",
+            lc[0]->stat(f) - before, f);
+    exit(1);
+  }
+  // a plain client waiting for f makes the server revoke it
+  lc[0]->acquire(f);
+  check_grant(f);
+  check_release(f);
+  lc[0]->release(f);
+  lcc[0]->acquire(f);
+  lcc[0]->release(f);
+}
+
+void
+test14(void)
+{
+  std::vector<std::future<lock_protocol::status> > f;
+
+  printf ("test14: one thread with many acquires outstanding\n");
+  lc[1]->acquire(a);
+  for (int i = 0; i < 200; i++)
+    f.push_back(lc[0]->acquire_async(i == 0 ? a : 0x2000000 + i));
+  // everything but a is granted; a waits for lc[1]
+  for (int i = 1; i < 200; i++)
+    assert(f[i].get() == lock_protocol::OK);
+  if (f[0].wait_for(std::chrono::milliseconds(200)) != std::future_status::timeout) {
+    fprintf(stderr, "error: async acquire of held lock %016llx completed\n", a);
+    exit(1);
+  }
+  lc[1]->release(a);
+  assert(f[0].get() == lock_protocol::OK);
+  check_grant(a);
+  check_release(a);
+
+  f.clear();
+  for (int i = 0; i < 200; i++)
+    f.push_back(lc[0]->release_async(i == 0 ? a : 0x2000000 + i));
+  for (int i = 0; i < 200; i++)
+    assert(f[i].get() == lock_protocol::OK);
+}
+
+void *
+test15(void *x)
+{
+  for (int j = 0; j < 100; j++) {
+    lc[0]->acquire(e);
+    check_grant(e);
+    check_release(e);
+    lc[0]->release(e);
+  }
+  return 0;
+}
+
+void *
+test16_acquirer(void *x)
+{
+  unsigned int *t = (unsigned int *) x;
+  lc[0]->acquire(0x3000001, t);
+  lc[0]->release(0x3000001);
+  return 0;
+}
+
+void
+test16(void)
+{
+  lock_protocol::lockid_t l = 0x3000000;
+  unsigned int t[4];
+
+  printf ("test16: every grant of a lock gets a larger fencing token\n");
+  lc[0]->acquire(l, &t[0]);
+  lc[0]->release(l);
+  lc[1]->acquire(l, &t[1]);
+  if (lc[0]->stat(l) != (int) t[1]) {
+    fprintf(stderr, "error: stat of %016llx is not its token %u\n", l, t[1]);
+    exit(1);
+  }
+  lc[1]->release(l);
+  lc[0]->acquire(l, &t[2]);
+  lc[0]->release(l);
+  // the record is freed, and must not start over from 0. looking at
+  // the lock meanwhile must not keep it alive.
+  lock_protocol::lock_stats st;
+  for (int i = 0; i < 30; i++) {
+    usleep(100000);
+    lc[0]->stat(l);
+    lc[0]->lock_stat(l, st);
+  }
+  if (lc[0]->lock_stat(l, st) != lock_protocol::NOENT) {
+    fprintf(stderr, "error: record of idle %016llx was not freed\n", l);
+    exit(1);
+  }
+  lc[1]->acquire(l, &t[3]);
+  lc[1]->release(l);
+  printf ("test16: tokens %u %u %u, then %u once the record was freed\n",
+          t[0], t[1], t[2], t[3]);
+  for (int i = 1; i < 4; i++) {
+    if (t[i] <= t[i-1]) {
+      fprintf(stderr, "error: token of %016llx went from %u to %u\n",
+              l, t[i-1], t[i]);
+      exit(1);
+    }
+  }
+
+  // two threads of one client that share a grant, and two reacquires
+  // of a cached lock, must not be handed the same token
+  unsigned int u[4];
+  pthread_t th[2];
+  l = 0x3000001;
+  lc[1]->acquire(l);
+  for (int i = 0; i < 2; i++) {
+    assert(pthread_create(&th[i], NULL, test16_acquirer, (void *) &u[i]) == 0);
+    usleep(200000);
+  }
+  lc[1]->release(l);
+  for (int i = 0; i < 2; i++)
+    pthread_join(th[i], NULL);
+  lock_client_cache *cc = new lock_client_cache(dst);
+  cc->acquire(l, &u[2]);
+  cc->release(l);
+  cc->acquire(l, &u[3]);
+  cc->release(l);
+  delete cc;
+  printf ("test16: local holders got tokens %u %u %u %u\n",
+          u[0], u[1], u[2], u[3]);
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < i; j++) {
+      if (u[i] == u[j]) {
+        fprintf(stderr, "error: two holders of %016llx got token %u\n",
+                l, u[i]);
+        exit(1);
+      }
+    }
+  }
+}
+
+// needs a server started with a grace period, e.g. lock_server -g 2000
+void
+test17(void)
+{
+  lock_protocol::lockid_t l = 0x4000000;
+
+  printf ("test17: locks of a client that goes away are released\n");
+  lock_client *gone = new lock_client(dst);
+  gone->acquire(l);
+  // drops the connection with l still held
+  delete gone;
+  time_t t0 = time(0);
+  lc[0]->acquire(l);
+  printf ("test17: got the lock %ld seconds after its holder went away\n",
+          (long)(time(0) - t0));
+  if (time(0) - t0 > 10) {
+    fprintf(stderr, "error: %016llx was not released in time\n", l);
+    exit(1);
+  }
+  lc[0]->release(l);
+}
+
+volatile int test18_phase;
+
+void *
+test18_holder(void *x)
+{
+  lock_protocol::lockid_t l = *(lock_protocol::lockid_t *) x;
+  assert(lc[0]->acquire(l) == lock_protocol::OK);
+  test18_phase = 1;
+  // waits for l + 1, held by client 1
+  assert(lc[0]->acquire(l + 1) == lock_protocol::OK);
+  lc[0]->release(l + 1);
+  lc[0]->release(l);
+  return 0;
+}
+
+void
+test18(void)
+{
+  lock_protocol::lockid_t x = 0x5000000, y = 0x5000001;
+  pthread_t th;
+
+  printf ("test18: an acquire that would close a cycle gets DEADLOCK\n");
+  lc[1]->acquire(y);
+  test18_phase = 0;
+  assert(pthread_create(&th, NULL, test18_holder, (void *) &x) == 0);
+  while (test18_phase != 1)
+    usleep(1000);
+  sleep(1);
+  // waiting for x would wait for the thread that waits for us
+  int r = lc[1]->acquire(x);
+  if (r != lock_protocol::DEADLOCK) {
+    fprintf(stderr, "error: acquire of %016llx returned %d, not DEADLOCK\n",
+            x, r);
+    exit(1);
+  }
+  lc[1]->release(y);
+  pthread_join(th, NULL);
+  // with the cycle gone, x can be had again
+  lc[1]->acquire(x);
+  lc[1]->release(x);
+}
+
+volatile int test19_got;
+
+void *
+test19_waiter(void *x)
+{
+  lock_protocol::lockid_t sid = *(lock_protocol::lockid_t *) x;
+  assert(lc[1]->sem_acquire(sid, 2) == lock_protocol::OK);
+  test19_got = 1;
+  return 0;
+}
+
+void
+test19(void)
+{
+  lock_protocol::lockid_t sid = 0x6000000;
+  pthread_t th;
+
+  printf ("test19: a semaphore hands out at most its capacity\n");
+  assert(lc[0]->sem_acquire(sid) == lock_protocol::NOENT);
+  assert(lc[0]->sem_init(sid, 3) == lock_protocol::OK);
+  assert(lc[0]->sem_acquire(sid, 4) == lock_protocol::RPCERR);
+  assert(lc[0]->sem_acquire(sid, 2) == lock_protocol::OK);
+  assert(lc[0]->sem_release(sid, 3) == lock_protocol::RPCERR);
+  // 2 + 2 > 3: waits until client 0 gives a unit back
+  assert(pthread_create(&th, NULL, test19_waiter, (void *) &sid) == 0);
+  sleep(1);
+  if (test19_got) {
+    fprintf(stderr, "error: semaphore %016llx went over capacity\n", sid);
+    exit(1);
+  }
+  assert(lc[0]->sem_release(sid) == lock_protocol::OK);
+  pthread_join(th, NULL);
+  assert(lc[0]->sem_release(sid) == lock_protocol::OK);
+  assert(lc[1]->sem_release(sid, 2) == lock_protocol::OK);
+}
+
+void
+test20(void)
+{
+  lock_protocol::lockid_t l = 0x7000000;
+  std::promise<bool> released;
+  std::future<bool> got = released.get_future();
+
+  printf ("test20: a watch is notified when the lock is released\n");
+  lock_client_cache *w = new lock_client_cache(dst);
+  lc[0]->acquire(l);
+  w->watch(l, [&released](lock_protocol::lockid_t, bool free) {
+    released.set_value(free);
+  });
+  usleep(200000);
+  if (got.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+    fprintf(stderr, "error: watch of held %016llx fired early\n", l);
+    exit(1);
+  }
+  lc[0]->release(l);
+  if (got.wait_for(std::chrono::seconds(10)) != std::future_status::ready ||
+      !got.get()) {
+    fprintf(stderr, "error: no notification that %016llx is free\n", l);
+    exit(1);
+  }
+  // a free lock is reported right away
+  bool now = false;
+  w->watch(l, [&now](lock_protocol::lockid_t, bool free) { now = free; });
+  assert(now);
+  delete w;
+}
+
+volatile int test21_phase, test21_got;
+
+void *
+test21_holder(void *x)
+{
+  lock_protocol::lockid_t l = *(lock_protocol::lockid_t *) x;
+  lc[0]->acquire(l);
+  assert(lc[0]->downgrade(l) == lock_protocol::OK);
+  test21_phase = 1;
+  while (test21_phase != 2)
+    usleep(10000);
+  lc[0]->release(l);
+  return 0;
+}
+
+void *
+test21_waiter(void *x)
+{
+  lock_protocol::lockid_t l = *(lock_protocol::lockid_t *) x;
+  lc[0]->acquire(l);
+  test21_got = 1;
+  lc[0]->release(l);
+  return 0;
+}
+
+void
+test21(void)
+{
+  lock_protocol::lockid_t l = 0x8000000;
+  pthread_t th[2];
+
+  printf ("test21: giving back a shared hold does not pass on the lock\n");
+  lc[1]->acquire(l);
+  // both threads of client 0 queue up while it waits, and share a grant
+  assert(pthread_create(&th[0], NULL, test21_holder, (void *) &l) == 0);
+  usleep(200000);
+  assert(pthread_create(&th[1], NULL, test21_waiter, (void *) &l) == 0);
+  usleep(200000);
+  lc[1]->release(l);
+  while (test21_phase != 1)
+    usleep(10000);
+  // the holder has downgraded, so a third thread can share the lock
+  assert(lc[0]->acquire_shared(l) == lock_protocol::OK);
+  lc[0]->release(l);
+  usleep(200000);
+  if (test21_got) {
+    fprintf(stderr, "error: %016llx was passed on while still held\n", l);
+    exit(1);
+  }
+  test21_phase = 2;
+  pthread_join(th[0], NULL);
+  pthread_join(th[1], NULL);
+  assert(test21_got);
+}
+
+void
+test22(void)
+{
+  printf ("test22: the ring spreads locks evenly, and a new shard takes "
+          "its share only\n");
+  const unsigned int nlocks = 100000;
+  for (unsigned int n = 2; n <= 8; n++) {
+    lock_ring a(n), b(n + 1);
+    std::vector<unsigned int> count(n, 0);
+    unsigned int moved = 0;
+    for (lock_protocol::lockid_t l = 0; l < nlocks; l++) {
+      unsigned int s = a.shard_of(l), t = b.shard_of(l);
+      count[s]++;
+      if (s != t) {
+        if (t != n) {
+          fprintf(stderr, "error: going to %u shards moved %016llx from "
+                  "shard %u to %u\n", n + 1, l, s, t);
+          exit(1);
+        }
+        moved++;
+      }
+    }
+    // 128 points per shard keep every share within about a third of
+    // the mean
+    for (unsigned int s = 0; s < n; s++) {
+      if (count[s] < nlocks / n * 2 / 3 || count[s] > nlocks / n * 4 / 3) {
+        fprintf(stderr, "error: shard %u of %u owns %u of %u locks\n",
+                s, n, count[s], nlocks);
+        exit(1);
+      }
+    }
+    printf ("test22: %u shards: %u of %u locks moved to shard %u\n",
+            n, moved, nlocks, n);
+    if (moved < nlocks / (n + 1) * 2 / 3 || moved > nlocks / (n + 1) * 4 / 3) {
+      fprintf(stderr, "error: going from %u to %u shards moved %u of %u "
+              "locks\n", n, n + 1, moved, nlocks);
+      exit(1);
+    }
+  }
+
+  // with several servers, one turns away a lock that is not its own
+  std::vector<std::string> servers;
+  std::stringstream ss(dst);
+  std::string one;
+  while (std::getline(ss, one, ','))
+    servers.push_back(one);
+  if (servers.size() < 2)
+    return;
+  lock_ring ring(servers.size());
+  lock_protocol::lockid_t l = 0x9000000;
+  while (ring.shard_of(l) != 0)
+    l++;
+  sockaddr_in sin;
+  make_sockaddr(servers[1].c_str(), &sin);
+  rpcc *cl = new rpcc(sin);
+  assert(cl->bind() == 0);
+  int r;
+  int ret = cl->call(lock_protocol::acquire, cl->id(), l, 0u, r);
+  if (ret != lock_protocol::RPCERR) {
+    fprintf(stderr, "error: shard 1 answered %d to an acquire of "
+            "%016llx, which is shard 0's\n", ret, l);
+    exit(1);
+  }
+  printf ("test22: shard 1 turned away %016llx, which is shard 0's\n", l);
+  delete cl;
+}
+
+volatile int test23_got;
+
+void *
+test23_waiter(void *x)
+{
+  lock_protocol::lockid_t l = *(lock_protocol::lockid_t *) x;
+  assert(lc[0]->acquire(l) == lock_protocol::OK);
+  lc[0]->release(l);
+  return 0;
+}
+
+void *
+test23_taker(void *x)
+{
+  lock_protocol::lockid_t l = *(lock_protocol::lockid_t *) x;
+  int r = lc[1]->acquire(l);
+  if (r != lock_protocol::OK) {
+    fprintf(stderr, "error: acquire of %016llx returned %d, not OK\n", l, r);
+    exit(1);
+  }
+  test23_got = 1;
+  lc[1]->release(l);
+  return 0;
+}
+
+void
+test23(void)
+{
+  lock_protocol::lockid_t x = 0xa000000, y = 0xa000001;
+  pthread_t th[2];
+
+  printf ("test23: threads of a client are apart in the wait-for graph\n");
+  lc[1]->acquire(y);
+  lc[0]->acquire(x);
+  // another thread of client 0 waits for y; the one holding x does not
+  assert(pthread_create(&th[0], NULL, test23_waiter, (void *) &y) == 0);
+  sleep(1);
+  // so another thread of client 1 may wait for x
+  test23_got = 0;
+  assert(pthread_create(&th[1], NULL, test23_taker, (void *) &x) == 0);
+  sleep(1);
+  if (test23_got) {
+    fprintf(stderr, "error: %016llx was granted while held\n", x);
+    exit(1);
+  }
+  lc[0]->release(x);
+  pthread_join(th[1], NULL);
+  lc[1]->release(y);
+  pthread_join(th[0], NULL);
+}
+
+volatile int test9_got;
+
+void *
+test9_cached(void *x)
+{
+  lock_client_cache *cc = (lock_client_cache *) x;
+  cc->acquire(0x8000000);
+  test9_got = 1;
+  return 0;
+}
+
+// needs a server started with a short lease, e.g. lock_server -l 500
+void
+test9(void)
+{
+  printf ("test9: renewed lease is kept, abandoned lease expires\n");
+  lc[0]->acquire(c);
+  for (int i = 0; i < 10; i++) {
+    usleep(200000);
+    assert(lc[0]->renew(c) == lock_protocol::OK);
+  }
+  time_t t0 = time(0);
+  lc[1]->acquire(c);
+  printf ("test9: client 1 got lock %ld seconds after client 0 stopped renewing\n",
+          (long)(time(0) - t0));
+  if (lc[0]->renew(c) != lock_protocol::NOENT) {
+    fprintf(stderr, "error: expired holder could still renew %016llx\n", c);
+    exit(1);
+  }
+  lc[1]->release(c);
+
+  // a cached lock outlives the lease: the cache renews it, so another
+  // client only gets it once the cache gives it back, and the cache
+  // only gets it again through the server
+  lock_protocol::lockid_t l = 0x8000000;
+  pthread_t th;
+  lock_client_cache *cc = new lock_client_cache(dst);
+  cc->acquire(l);
+  cc->release(l);
+  sleep(3);
+  lc[1]->acquire(l);
+  test9_got = 0;
+  assert(pthread_create(&th, NULL, test9_cached, (void *) cc) == 0);
+  sleep(1);
+  if (test9_got) {
+    fprintf(stderr, "error: cache served %016llx while another client "
+            "held it\n", l);
+    exit(1);
+  }
+  lc[1]->release(l);
+  pthread_join(th, NULL);
+  cc->release(l);
+  delete cc;
+  printf ("test9: a cached lock was kept past its lease, and handed over\n");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -165,8 +905,8 @@ main(int argc, char *argv[])
 
     if (argc > 2) {
       test = atoi(argv[2]);
-      if(test < 1 || test > 5){
-        printf("Test number must be between 1 and 5\n");
+      if(test < 1 || test > 23){
+        printf("Test number must be between 1 and 23\n");
         exit(1);
       }
     }
@@ -235,6 +975,157 @@ main(int argc, char *argv[])
       }
     }
 
+    if(!test || test == 6){
+      printf("test 6\n");
+
+      // test 6: waiters are granted b in the order they asked for it
+      lc[0]->acquire(b);
+      check_grant(b);
+      for (int i = 1; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test6, (void *) a);
+	assert (r == 0);
+      }
+      usleep(nt * 50000 + 200000);
+      check_release(b);
+      lc[0]->release(b);
+      for (int i = 1; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+      for (int i = 0; i < ngranted; i++) {
+	if (grant_order[i] != i + 1) {
+	  fprintf(stderr, "error: client %d was granted b out of order\n", grant_order[i]);
+	  exit(1);
+	}
+      }
+    }
+
+    if(!test || test == 7){
+      printf("test 7\n");
+      test7();
+    }
+
+    if(!test || test == 8){
+      printf("test 8\n");
+
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test8, (void *) a);
+	assert (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+    }
+
+    if(!test || test == 10){
+      printf("test 10\n");
+      test10();
+    }
+
+    if(!test || test == 11){
+      printf("test 11\n");
+      test11();
+    }
+
+    if(!test || test == 12){
+      printf("test 12\n");
+      test12();
+    }
+
+    if(!test || test == 13){
+      printf("test 13\n");
+      test13();
+      for (int i = 0; i < 10; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test13_user, (void *) a);
+	assert (r == 0);
+      }
+      for (int i = 0; i < 10; i++) {
+	pthread_join(th[i], NULL);
+      }
+      // hand the cached locks back, or later clients would wait forever
+      for (int i = 0; i < 3; i++)
+	delete lcc[i];
+    }
+
+    if(!test || test == 14){
+      printf("test 14\n");
+      test14();
+    }
+
+    if(!test || test == 15){
+      printf("test 15\n");
+      // test 15: threads of one client share its request for a lock, so
+      // the server never has more than one of them waiting, and most of
+      // its grants cover several of them
+      lock_protocol::lock_stats before, after;
+      if (lc[0]->lock_stat(e, before) != lock_protocol::OK)
+	before.acquires = before.waits = 0;
+      for (int i = 0; i < 10; i++) {
+	r = pthread_create(&th[i], NULL, test15, (void *) 0);
+	assert (r == 0);
+      }
+      for (int i = 0; i < 10; i++) {
+	pthread_join(th[i], NULL);
+      }
+      assert(lc[0]->lock_stat(e, after) == lock_protocol::OK);
+      printf ("test15: 1000 acquires took %llu at the server, %llu waited there\n",
+	      after.acquires - before.acquires, after.waits - before.waits);
+      if (after.waits != before.waits ||
+	  after.acquires - before.acquires > 25 * 10) {
+	fprintf(stderr, "error: acquires of %016llx were not coalesced\n", e);
+	exit(1);
+      }
+    }
+
+    if(!test || test == 16){
+      printf("test 16\n");
+      test16();
+    }
+
+    if(!test || test == 18){
+      printf("test 18\n");
+      test18();
+    }
+
+    if(!test || test == 19){
+      printf("test 19\n");
+      test19();
+    }
+
+    if(!test || test == 20){
+      printf("test 20\n");
+      test20();
+    }
+
+    if(!test || test == 21){
+      printf("test 21\n");
+      test21();
+    }
+
+    if(!test || test == 22){
+      printf("test 22\n");
+      test22();
+    }
+
+    if(!test || test == 23){
+      printf("test 23\n");
+      test23();
+    }
+
+    // only on request: the server must be handing out leases
+    if(test == 9){
+      printf("test 9\n");
+      test9();
+    }
+
+    // only on request: the server must be keeping a grace period
+    if(test == 17){
+      printf("test 17\n");
+      test17();
+    }
+
     printf ("%s: passed all tests successfully\n", argv[0]);
 
 }
@@ -126,6 +126,7 @@ connection::send(char *b, int sz)
 
 	if (!writepdu()) {
 		dead_ = true;
+		mgr_->lost_conn(this);
 		assert(pthread_mutex_unlock(&m_) == 0);
 		PollMgr::Instance()->block_remove_fd(fd_);
 		assert(pthread_mutex_lock(&m_) == 0);
@@ -161,6 +162,7 @@ connection::write_cb(int s)
 	if (!writepdu()) {
 		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
 		dead_ = true;
+		mgr_->lost_conn(this);
 	}else{
 		assert(wpdu_.solong >= 0);
 		if (wpdu_.solong < wpdu_.sz) {
@@ -189,6 +191,7 @@ connection::read_cb(int s)
 		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
 		dead_ = true;
 		pthread_cond_signal(&send_complete_);
+		mgr_->lost_conn(this);
 	}
 
 	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
@@ -301,6 +304,9 @@ tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
 		perror("accept_loop tcp bind:");
 		assert(0);
 	}
+	socklen_t sinlen = sizeof(sin);
+	assert(getsockname(tcp_, (sockaddr *)&sin, &sinlen) == 0);
+	port_ = ntohs(sin.sin_port);
 
 	if(listen(tcp_, 1000) < 0) {
 		perror("tcpsconn::tcpsconn listen:");
@@ -15,6 +15,9 @@ class connection;
 class chanmgr {
 	public:
 		virtual bool got_pdu(connection *c, char *b, int sz) = 0;
+		// c died on its own (not through closeconn()). like got_pdu,
+		// called with c's mutex held and must not block
+		virtual void lost_conn(connection *c) {}
 		virtual ~chanmgr() {}
 };
 
@@ -71,6 +74,7 @@ class tcpsconn {
 		~tcpsconn();
 
 		void accept_conn();
+		int port() { return port_; } // the one bound, if asked for 0
 	private:
 
 		pthread_mutex_t m_;
@@ -78,6 +82,7 @@ class tcpsconn {
 		int pipe_[2];
 
 		int tcp_; //file desciptor for accepting connection
+		int port_;
 		chanmgr *mgr_;
 		int lossy_;
 		std::map<int, connection *> conns_;
@@ -65,6 +65,7 @@
 #include "slock.h"
 
 #include <sys/types.h>
+#include <algorithm>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <time.h>
@@ -76,8 +77,10 @@
 const rpcc::TO rpcc::to_max = {120000};
 const rpcc::TO rpcc::to_min = {1000};
 
-rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-	: xid(xxid), un(xun), done(false)
+rpcc::caller::caller()
+	: xid(0), un(NULL), intret(0), done(false), cb(NULL), ch(NULL),
+	  lost(false), deadline(0), rto(0), sent(0), resent(false),
+	  timed(true)
 {
 	assert(pthread_mutex_init(&m, 0) == 0);
 	assert(pthread_cond_init(&c, 0) == 0);
@@ -89,6 +92,188 @@ rpcc::caller::~caller()
 	assert(pthread_cond_destroy(&c) == 0);
 }
 
+// assumes thread holds mutex m_
+rpcc::caller *rpcc::get_caller(unsigned int xid, unmarshall *un)
+{
+	caller *ca;
+	if (free_callers_.empty())
+		ca = new caller();
+	else
+	{
+		ca = free_callers_.back();
+		free_callers_.pop_back();
+	}
+	ca->xid = xid;
+	ca->un = un;
+	ca->intret = 0;
+	ca->done = false;
+	ca->cb = NULL;
+	ca->ch = NULL;
+	ca->lost = false;
+	ca->resent = false;
+	ca->timed = true;
+	return ca;
+}
+
+// assumes thread holds mutex m_, and that ca is no longer in calls_
+void rpcc::put_caller(caller *ca)
+{
+	free_callers_.push_back(ca);
+}
+
+// assumes thread holds mutex m_
+rpcc::caller *rpcc::find_call(unsigned int xid)
+{
+	unsigned int mask = calls_.size() - 1;
+	for (unsigned int i = xid & mask; calls_[i]; i = (i + 1) & mask)
+		if (calls_[i]->xid == xid)
+			return calls_[i];
+	return NULL;
+}
+
+// assumes thread holds mutex m_
+void rpcc::add_call(caller *ca)
+{
+	if ((ncalls_ + 1) * 2 > calls_.size())
+		resize_calls(calls_.size() * 2);
+	unsigned int mask = calls_.size() - 1;
+	unsigned int i = ca->xid & mask;
+	while (calls_[i])
+		i = (i + 1) & mask;
+	calls_[i] = ca;
+	ncalls_++;
+}
+
+// assumes thread holds mutex m_
+void rpcc::erase_call(unsigned int xid)
+{
+	unsigned int mask = calls_.size() - 1;
+	unsigned int i = xid & mask;
+	while (calls_[i] && calls_[i]->xid != xid)
+		i = (i + 1) & mask;
+	if (!calls_[i])
+		return;
+	calls_[i] = NULL;
+	ncalls_--;
+	// moves the rest of the run back over the hole where that keeps
+	// each call reachable from its home slot, so lookups can stop at
+	// the first free slot
+	for (unsigned int j = (i + 1) & mask; calls_[j]; j = (j + 1) & mask)
+	{
+		unsigned int home = calls_[j]->xid & mask;
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			calls_[i] = calls_[j];
+			calls_[j] = NULL;
+			i = j;
+		}
+	}
+	if (calls_.size() > 64 && ncalls_ * 8 < calls_.size())
+		resize_calls(calls_.size() / 2);
+}
+
+// assumes thread holds mutex m_
+void rpcc::resize_calls(unsigned int size)
+{
+	std::vector<caller *> old(size, NULL);
+	old.swap(calls_);
+	unsigned int mask = size - 1;
+	for (unsigned int i = 0; i < old.size(); i++)
+	{
+		if (!old[i])
+			continue;
+		unsigned int j = old[i]->xid & mask;
+		while (calls_[j])
+			j = (j + 1) & mask;
+		calls_[j] = old[i];
+	}
+}
+
+// granularity of the asynchronous calls' timers
+static const unsigned int async_tick_ms = 50;
+
+static unsigned long long
+now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long
+now_ms()
+{
+	return now_us() / 1000;
+}
+
+// the retransmission timeout never goes below this (ms)
+static const int rto_floor_ms = 10;
+
+// srtt + 4 * rttvar, as in Jacobson and Karels' "Congestion Avoidance
+// and Control", between rto_floor_ms and to_min; to_min before the
+// first reply. assumes thread holds mutex m_.
+int rpcc::rto_locked()
+{
+	if (srtt_ == 0)
+		return to_min.to;
+	long long rto = (srtt_ + 4 * rttvar_ + 999) / 1000;
+	return (int)std::max((long long)rto_floor_ms,
+			std::min(rto, (long long)to_min.to));
+}
+
+int rpcc::rto()
+{
+	ScopedLock ml(&m_);
+	return rto_locked();
+}
+
+unsigned int rpcc::call_slots()
+{
+	ScopedLock ml(&m_);
+	return calls_.size();
+}
+
+void rpcc::untimed(unsigned int proc)
+{
+	ScopedLock ml(&m_);
+	untimed_.insert(proc);
+}
+
+// folds the round trip of ca, whose reply just came, into srtt_ and
+// rttvar_. replies to resent requests don't count (Karn's rule), nor do
+// those of untimed procs. a reply that took longer than the timeout
+// counts as twice the timeout: the estimate still rises, a step at a
+// time, when the network gets slower, but one reply that a handler
+// held back cannot drag it to to_min at once.
+// assumes thread holds mutex m_.
+void rpcc::rtt_sample(caller *ca)
+{
+	if (ca->resent || !ca->timed)
+		return;
+	long long r = std::min((long long)(now_us() - ca->sent),
+			2LL * rto_locked() * 1000);
+	if (r < 1)
+		r = 1;
+	if (srtt_ == 0)
+	{
+		srtt_ = r;
+		rttvar_ = r / 2;
+		return;
+	}
+	long long err = r - srtt_;
+	srtt_ += err / 8;
+	if (srtt_ < 1)
+		srtt_ = 1;
+	rttvar_ += ((err < 0 ? -err : err) - rttvar_) / 4;
+}
+
+// the first async tick at or after ms
+static unsigned long long
+async_tick(unsigned long long ms)
+{
+	return (ms + async_tick_ms - 1) / async_tick_ms;
+}
+
 inline void set_rand_seed()
 {
 	struct timespec ts;
@@ -97,10 +282,14 @@ inline void set_rand_seed()
 }
 
 rpcc::rpcc(sockaddr_in d, bool retrans) : dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
-										  retrans_(retrans), chan_(NULL)
+										  retrans_(retrans), srtt_(0), rttvar_(0), chan_(NULL), calls_(64, NULL), ncalls_(0),
+										  async_timers_(now_ms() / async_tick_ms),
+										  done_th_started_(false), stopping_(false)
 {
 	assert(pthread_mutex_init(&m_, 0) == 0);
 	assert(pthread_mutex_init(&chan_m_, 0) == 0);
+	assert(pthread_mutex_init(&lost_m_, 0) == 0);
+	assert(pthread_cond_init(&async_c_, 0) == 0);
 
 	if (retrans)
 	{
@@ -121,9 +310,6 @@ rpcc::rpcc(sockaddr_in d, bool retrans) : dst_(d), srv_nonce_(0), bind_done_(fal
 		lossytest_ = atoi(loss_env);
 	}
 
-	// xid starts with 1 and latest received reply starts with 0
-	xid_rep_window_.push_back(0);
-
 	jsl_log(JSL_DBG_2, "rpcc::rpcc cltn_nonce is %d lossy %d\n",
 			clt_nonce_, lossytest_);
 }
@@ -139,9 +325,24 @@ rpcc::~rpcc()
 		chan_->closeconn();
 		chan_->decref();
 	}
-	assert(calls_.size() == 0);
+	assert(ncalls_ == 0);
+	if (done_th_started_)
+	{
+		{
+			ScopedLock ml(&m_);
+			stopping_ = true;
+			assert(pthread_cond_signal(&async_c_) == 0);
+		}
+		assert(pthread_join(done_th_, NULL) == 0);
+	}
+	for (unsigned i = 0; i < lost_conns_.size(); i++)
+		lost_conns_[i]->decref();
+	for (unsigned i = 0; i < free_callers_.size(); i++)
+		delete free_callers_[i];
 	assert(pthread_mutex_destroy(&m_) == 0);
 	assert(pthread_mutex_destroy(&chan_m_) == 0);
+	assert(pthread_mutex_destroy(&lost_m_) == 0);
+	assert(pthread_cond_destroy(&async_c_) == 0);
 }
 
 int rpcc::bind(TO to)
@@ -166,7 +367,8 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 				TO to)
 {
 
-	caller ca(0, &rep);
+	caller *ca;
+	TO curr_to;
 	{
 		ScopedLock ml(&m_);
 
@@ -177,19 +379,20 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 			return rpc_const::bind_failure;
 		}
 
-		ca.xid = xid_++;
-		calls_[ca.xid] = &ca;
+		ca = get_caller(xid_++, &rep);
+		ca->sent = now_us();
+		ca->timed = !untimed_.count(proc);
+		add_call(ca);
 
-		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
+		req_header h(ca->xid, proc, clt_nonce_, srv_nonce_, xid_rep_.upto());
 		req.pack_req_header(h);
+		curr_to.to = rto_locked();
 	}
 
-	TO curr_to;
 	struct timespec now, nextdeadline, finaldeadline;
 
 	clock_gettime(CLOCK_REALTIME, &now);
 	add_timespec(now, to.to, &finaldeadline);
-	curr_to.to = to_min.to;
 
 	bool transmit = true;
 	connection *ch = NULL;
@@ -205,7 +408,7 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 				ch->send(req.cstr(), req.size());
 				jsl_log(JSL_DBG_2,
 						"rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
-						clt_nonce_, proc, ca.xid, clt_nonce_);
+						clt_nonce_, proc, ca->xid, clt_nonce_);
 			}
 			transmit = false; // only send once on a given channel
 		}
@@ -222,13 +425,13 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		}
 
 		{
-			ScopedLock cal(&ca.m);
-			while (!ca.done)
+			ScopedLock cal(&ca->m);
+			while (!ca->done)
 			{
-				if (pthread_cond_timedwait(&ca.c, &ca.m, &nextdeadline) == ETIMEDOUT)
+				if (pthread_cond_timedwait(&ca->c, &ca->m, &nextdeadline) == ETIMEDOUT)
 					break;
 			}
-			if (ca.done)
+			if (ca->done)
 				break;
 		}
 
@@ -236,30 +439,311 @@ int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		{
 			// since connection is dead, we retransmit on the new connection
 			transmit = true;
+			ScopedLock ml(&m_);
+			ca->resent = true;
 		}
 		curr_to.to <<= 1;
 	}
 
+	int ret;
 	{
-		ScopedLock ml(&m_); // no locking of ca.m because no one but this thread changes ca.xid
-		calls_.erase(ca.xid);
+		// got_pdu only touches ca while it is in calls_ and m_ is
+		// held, so once it is out ca is ours again
+		ScopedLock ml(&m_);
+		erase_call(ca->xid);
 		// we potentially need to update the xid again here, in case the
 		// packet times out before it's even sent by the channel.  nasty.
 		// but I don't think there's any harm in potentially doing it twice
-		update_xid_rep(ca.xid);
+		xid_rep_.done(ca->xid);
+
+		jsl_log(JSL_DBG_2,
+				"rpcc::call1 %u wait over for req proc %x xid %u %s:%d done? %d ret %d \n",
+				clt_nonce_, proc, ca->xid, inet_ntoa(dst_.sin_addr),
+				ntohs(dst_.sin_port), ca->done, ca->intret);
+		ret = ca->done ? ca->intret : rpc_const::timeout_failure;
+		put_caller(ca);
 	}
 
-	ScopedLock cal(&ca.m);
+	if (ch)
+		ch->decref();
+	// destruction of req automatically frees its buffer
+	return ret;
+}
 
-	jsl_log(JSL_DBG_2,
-			"rpcc::call1 %u wait over for req proc %x xid %u %s:%d done? %d ret %d \n",
-			clt_nonce_, proc, ca.xid, inet_ntoa(dst_.sin_addr),
-			ntohs(dst_.sin_port), ca.done, ca.intret);
+// like call1, but returns as soon as req is sent. cb->done() runs exactly
+// once, on the rpcc's completion thread, so it may make further calls;
+// callbacks run one at a time and should not block for long. as with
+// call1, the request is sent again if its connection dies (unless
+// retransmission is off, in which case the call fails at once), and
+// the call fails with timeout_failure if no reply came within to.
+void rpcc::call1_async(unsigned int proc, marshall &req, rpc_callback *cb,
+		TO to)
+{
+	connection *ch = NULL;
+	get_refconn(&ch);
+	// one reference for the caller, one for sending below: once it is
+	// in calls_ it may be finished and put back by another thread.
+	// connections are never locked under m_ (see check_async).
+	if (ch)
+		ch->incref();
+
+	unsigned int xid;
+	bool bound;
+	{
+		ScopedLock ml(&m_);
 
+		if (!done_th_started_)
+		{
+			done_th_ = method_thread(this, false, &rpcc::done_loop);
+			done_th_started_ = true;
+		}
+
+		xid = xid_++;
+		caller *ca = get_caller(xid, new unmarshall());
+		ca->cb = cb;
+		ca->ch = ch;
+		ca->timed = !untimed_.count(proc);
+
+		bound = proc != rpc_const::bind && bind_done_;
+		if (bound)
+		{
+			req_header h(xid, proc, clt_nonce_, srv_nonce_, xid_rep_.upto());
+			req.pack_req_header(h);
+			ca->req.assign(req.cstr(), req.size());
+			ca->sent = now_us();
+			unsigned long long now = ca->sent / 1000;
+			ca->deadline = now + to.to;
+			ca->rto = rto_locked();
+			async_timers_.add(xid, async_tick(std::min(now + ca->rto, ca->deadline)));
+			assert(pthread_cond_signal(&async_c_) == 0);
+		}
+		add_call(ca);
+	}
+
+	if (!bound)
+	{
+		jsl_log(JSL_DBG_1, "rpcc::call1_async rpcc has not been bound to dst\n");
+		finish_async(xid, rpc_const::bind_failure);
+	}
+	else if (!ch || !ch->send(req.cstr(), req.size()))
+	{
+		// the timer sends it again on a new connection
+		if (!retrans_)
+			finish_async(xid, rpc_const::timeout_failure);
+		else
+		{
+			ScopedLock ml(&m_);
+			mark_lost(std::vector<unsigned int>(1, xid));
+		}
+	}
+	else
+		jsl_log(JSL_DBG_2,
+				"rpcc::call1_async %u just sent req proc %x xid %u\n",
+				clt_nonce_, proc, xid);
 	if (ch)
 		ch->decref();
-	// destruction of req automatically frees its buffer
-	return (ca.done ? ca.intret : rpc_const::timeout_failure);
+}
+
+// hands the asynchronous call xid to the completion thread with ret,
+// unless its reply (or another failure) got there first
+void rpcc::finish_async(unsigned int xid, int ret)
+{
+	ScopedLock ml(&m_);
+	caller *ca = find_call(xid);
+	if (ca == NULL)
+		return;
+	erase_call(xid);
+	xid_rep_.done(xid);
+	ca->intret = ret;
+	done_.push_back(ca);
+	assert(pthread_cond_signal(&async_c_) == 0);
+}
+
+// the connection that asynchronous calls went out on died: they will
+// get no reply on it. c's mutex is held, and paths that hold m_ may
+// be waiting for it, so this only queues c for the completion thread
+// (see conn_lost). only asynchronous calls care, and there are none
+// before the completion thread is started.
+void rpcc::lost_conn(connection *c)
+{
+	if (!done_th_started_)
+		return;
+	c->incref();
+	{
+		ScopedLock ll(&lost_m_);
+		lost_conns_.push_back(c);
+	}
+	// without m_, so the completion thread may miss this; then it
+	// finds c at its next tick, which every outstanding call has
+	assert(pthread_cond_signal(&async_c_) == 0);
+}
+
+// the asynchronous calls that went out on c will get no reply on it.
+// with retransmission their timers come due at once, to send them
+// again; without it they fail, and their xids go in failed. assumes
+// thread holds mutex m_.
+void rpcc::conn_lost(connection *c, std::vector<unsigned int> &failed)
+{
+	for (unsigned i = 0; i < calls_.size(); i++)
+	{
+		if (!calls_[i] || !calls_[i]->cb || calls_[i]->ch != c)
+			continue;
+		calls_[i]->lost = true;
+		if (retrans_)
+			async_timers_.add(calls_[i]->xid, 0);
+		else
+			failed.push_back(calls_[i]->xid);
+	}
+}
+
+// the asynchronous calls in due had their timers come due: those past
+// their deadline fail, the others are sent again if their connection
+// died, and all of them wait twice as long for the next look.
+// assumes thread holds mutex m_; drops it while sending. a connection
+// holds its own mutex when it calls got_pdu or lost_conn, which take
+// m_, so nothing here may lock a connection (isdead, send, a decref
+// that may delete it) with m_ held.
+void rpcc::check_async(std::vector<unsigned int> &due)
+{
+	unsigned long long now = now_ms();
+	std::vector<std::pair<unsigned int, std::string> > resend;
+	for (unsigned i = 0; i < due.size(); i++)
+	{
+		caller *ca = find_call(due[i]);
+		// finished since; the wheel has no cancel
+		if (ca == NULL || ca->cb == NULL)
+			continue;
+		if (now >= ca->deadline)
+		{
+			erase_call(ca->xid);
+			xid_rep_.done(ca->xid);
+			ca->intret = rpc_const::timeout_failure;
+			done_.push_back(ca);
+			continue;
+		}
+		if (retrans_ && (!ca->ch || ca->lost))
+			resend.push_back(std::make_pair(ca->xid, ca->req));
+		if (ca->rto < to_max.to)
+			ca->rto <<= 1;
+		async_timers_.add(ca->xid, async_tick(std::min(now + ca->rto, ca->deadline)));
+	}
+	if (resend.empty())
+		return;
+
+	pthread_mutex_unlock(&m_);
+	connection *ch = NULL;
+	get_refconn(&ch);
+	if (ch == NULL)
+	{
+		pthread_mutex_lock(&m_);
+		return;
+	}
+	// a reference for each caller that moves to ch
+	for (unsigned i = 0; i < resend.size(); i++)
+		ch->incref();
+	std::vector<connection *> unref(1, ch);
+	{
+		ScopedLock ml(&m_);
+		for (unsigned i = 0; i < resend.size(); i++)
+		{
+			caller *ca = find_call(resend[i].first);
+			if (ca == NULL)
+			{
+				unref.push_back(ch);
+				continue;
+			}
+			unref.push_back(ca->ch);
+			ca->ch = ch;
+			ca->lost = false;
+			ca->resent = true;
+		}
+	}
+	// sent after the callers point at ch, so that lost_conn finds them
+	// if ch dies too
+	std::vector<unsigned int> failed;
+	for (unsigned i = 0; i < resend.size(); i++)
+	{
+		if (!ch->send((char *)resend[i].second.data(), resend[i].second.size()))
+			failed.push_back(resend[i].first);
+		jsl_log(JSL_DBG_2, "rpcc::check_async %u sent xid %u again\n",
+				clt_nonce_, resend[i].first);
+	}
+	for (unsigned i = 0; i < unref.size(); i++)
+	{
+		if (unref[i])
+			unref[i]->decref();
+	}
+	pthread_mutex_lock(&m_);
+	mark_lost(failed);
+}
+
+// the asynchronous calls xids could not be sent: they go out again when
+// their timers come due. assumes thread holds mutex m_.
+void rpcc::mark_lost(const std::vector<unsigned int> &xids)
+{
+	for (unsigned i = 0; i < xids.size(); i++)
+	{
+		caller *ca = find_call(xids[i]);
+		if (ca && ca->cb)
+			ca->lost = true;
+	}
+}
+
+// the completion thread: runs callbacks and drives the timers
+void rpcc::done_loop()
+{
+	ScopedLock ml(&m_);
+	while (1)
+	{
+		std::vector<connection *> lost;
+		{
+			ScopedLock ll(&lost_m_);
+			lost.swap(lost_conns_);
+		}
+		if (!lost.empty())
+		{
+			std::vector<unsigned int> failed;
+			for (unsigned i = 0; i < lost.size(); i++)
+				conn_lost(lost[i], failed);
+			pthread_mutex_unlock(&m_);
+			for (unsigned i = 0; i < lost.size(); i++)
+				lost[i]->decref();
+			for (unsigned i = 0; i < failed.size(); i++)
+				finish_async(failed[i], rpc_const::timeout_failure);
+			pthread_mutex_lock(&m_);
+		}
+		if (!done_.empty())
+		{
+			caller *ca = done_.front();
+			done_.pop_front();
+			pthread_mutex_unlock(&m_);
+			ca->cb->done(ca->intret, *ca->un);
+			if (ca->ch)
+				ca->ch->decref();
+			delete ca->un;
+			pthread_mutex_lock(&m_);
+			put_caller(ca);
+			continue;
+		}
+		if (stopping_)
+			break;
+		std::vector<unsigned int> due;
+		async_timers_.advance(now_ms() / async_tick_ms, due);
+		if (!due.empty())
+		{
+			check_async(due);
+			continue;
+		}
+		if (async_timers_.size() == 0)
+			assert(pthread_cond_wait(&async_c_, &m_) == 0);
+		else
+		{
+			struct timespec now, next;
+			clock_gettime(CLOCK_REALTIME, &now);
+			add_timespec(now, async_tick_ms, &next);
+			pthread_cond_timedwait(&async_c_, &m_, &next);
+		}
+	}
 }
 
 void rpcc::get_refconn(connection **ch)
@@ -302,18 +786,30 @@ bool rpcc::got_pdu(connection *c, char *b, int sz)
 
 	ScopedLock ml(&m_);
 
-	update_xid_rep(h.xid);
+	xid_rep_.done(h.xid);
 
-	if (calls_.find(h.xid) == calls_.end())
+	caller *ca = find_call(h.xid);
+	if (ca == NULL)
 	{
 		jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
 		return true;
 	}
-	caller *ca = calls_[h.xid];
+
+	if (ca->cb)
+	{
+		rtt_sample(ca);
+		ca->un->take_in(rep);
+		ca->intret = h.ret;
+		erase_call(h.xid);
+		done_.push_back(ca);
+		assert(pthread_cond_signal(&async_c_) == 0);
+		return true;
+	}
 
 	ScopedLock cl(&ca->m);
 	if (!ca->done)
 	{
+		rtt_sample(ca);
 		ca->un->take_in(rep);
 		ca->intret = h.ret;
 		if (ca->intret < 0)
@@ -327,45 +823,18 @@ bool rpcc::got_pdu(connection *c, char *b, int sz)
 	return true;
 }
 
-// assumes thread holds mutex m
-void rpcc::update_xid_rep(unsigned int xid)
-{
-	std::list<unsigned int>::iterator it;
-
-	if (xid <= xid_rep_window_.front())
-	{
-		return;
-	}
-
-	for (it = xid_rep_window_.begin(); it != xid_rep_window_.end(); it++)
-	{
-		if (*it > xid)
-		{
-			xid_rep_window_.insert(it, xid);
-			goto compress;
-		}
-	}
-	xid_rep_window_.push_back(xid);
-
-compress:
-	it = xid_rep_window_.begin();
-	for (it++; it != xid_rep_window_.end(); it++)
-	{
-		while (xid_rep_window_.front() + 1 == *it)
-			xid_rep_window_.pop_front();
-	}
-}
-
-rpcs::rpcs(unsigned int p1, int count)
-	: port_(p1), counting_(count), curr_counts_(count), lossytest_(0)
+rpcs::rpcs(unsigned int p1, int count, unsigned int nonce)
+	: port_(p1), watcher_(NULL), lost_pending_(false), counting_(count),
+	  curr_counts_(count), lossytest_(0)
 {
 	assert(pthread_mutex_init(&procs_m_, 0) == 0);
+	assert(pthread_mutex_init(&lost_m_, 0) == 0);
 	assert(pthread_mutex_init(&count_m_, 0) == 0);
 	assert(pthread_mutex_init(&reply_window_m_, 0) == 0);
 	assert(pthread_mutex_init(&conss_m_, 0) == 0);
 
 	set_rand_seed();
-	nonce_ = random();
+	nonce_ = nonce ? nonce : random();
 	jsl_log(JSL_DBG_2, "rpcs::rpcs created with nonce %d\n", nonce_);
 
 	char *loss_env = getenv("RPC_LOSSY");
@@ -378,6 +847,7 @@ rpcs::rpcs(unsigned int p1, int count)
 	dispatchpool_ = new ThrPool(10, false);
 
 	listener_ = new tcpsconn(this, port_, lossytest_);
+	port_ = listener_->port();
 }
 
 rpcs::~rpcs()
@@ -385,6 +855,8 @@ rpcs::~rpcs()
 	// must delete listener before dispatchpool
 	delete listener_;
 	delete dispatchpool_;
+	for (unsigned i = 0; i < lost_conns_.size(); i++)
+		lost_conns_[i]->decref();
 	free_reply_window();
 }
 
@@ -401,6 +873,52 @@ bool rpcs::got_pdu(connection *c, char *b, int sz)
 	return succ;
 }
 
+void rpcs::set_watcher(rpcs_watcher *w)
+{
+	ScopedLock rwl(&conss_m_);
+	watcher_ = w;
+}
+
+// c's mutex is held here, so finding out whose connection c was is
+// left to a dispatch thread. c is queued rather than handed to the job,
+// so that it is not forgotten when the pool's queue is full: the next
+// job to run, a dispatch or a conns_gone, looks at it.
+void rpcs::lost_conn(connection *c)
+{
+	c->incref();
+	{
+		ScopedLock ll(&lost_m_);
+		lost_conns_.push_back(c);
+		lost_pending_ = true;
+	}
+	dispatchpool_->addObjJob(this, &rpcs::conns_gone, true);
+}
+
+void rpcs::conns_gone(bool)
+{
+	std::vector<connection *> lost;
+	{
+		ScopedLock ll(&lost_m_);
+		lost.swap(lost_conns_);
+		lost_pending_ = false;
+	}
+	for (unsigned i = 0; i < lost.size(); i++)
+	{
+		{
+			ScopedLock rwl(&conss_m_);
+			std::map<unsigned int, connection *>::iterator it;
+			for (it = conns_.begin(); watcher_ && it != conns_.end(); it++)
+			{
+				// a client that has already moved on to a new
+				// connection did not lose anything
+				if (it->second == lost[i])
+					watcher_->client_lost(it->first);
+			}
+		}
+		lost[i]->decref();
+	}
+}
+
 void rpcs::reg1(unsigned int proc, handler *h)
 {
 	ScopedLock pl(&procs_m_);
@@ -439,6 +957,9 @@ void rpcs::updatestat(unsigned int proc)
 
 void rpcs::dispatch(djob_t *j)
 {
+	if (lost_pending_)
+		conns_gone(true);
+
 	connection *c = j->conn;
 	unmarshall req(j->buf, j->sz);
 	delete j;
@@ -488,6 +1009,7 @@ void rpcs::dispatch(djob_t *j)
 		f = procs_[proc];
 	}
 
+	deferred_handler *df;
 	rpcs::rpcstate_t stat;
 	char *b1;
 	int sz1;
@@ -514,9 +1036,15 @@ void rpcs::dispatch(djob_t *j)
 			{
 				c->incref();
 				conns_[h.clt_nonce] = c;
+				// a restarted server may be waiting to hear from
+				// the clients it had before
+				if (watcher_)
+					watcher_->client_back(h.clt_nonce);
 			}
 			else if (conns_[h.clt_nonce] != c)
 			{
+				if (watcher_ && conns_[h.clt_nonce]->isdead())
+					watcher_->client_back(h.clt_nonce);
 				conns_[h.clt_nonce]->decref();
 				c->incref();
 				conns_[h.clt_nonce] = c;
@@ -540,40 +1068,20 @@ void rpcs::dispatch(djob_t *j)
 			updatestat(proc);
 		}
 
-		rh.ret = f->fn(req, rep);
-		assert(rh.ret >= 0 ||
-			   rh.ret == rpc_const::unmarshal_args_failure);
-
-		rep.pack_reply_header(rh);
-		rep.take_buf(&b1, &sz1);
-
-		jsl_log(JSL_DBG_2,
-				"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
-				sz1, h.xid, proc, rh.ret, h.clt_nonce);
-
-		if (h.clt_nonce > 0)
+		df = dynamic_cast<deferred_handler *>(f);
+		if (df != NULL)
 		{
-			// only record replies for clients that require at-most-once logic
-			add_reply(h.clt_nonce, h.xid, b1, sz1);
+			// the handler keeps the request and replies when it is ready,
+			// so this dispatch thread goes straight back to the pool
+			df->dfn(req, new deferred_reply(this, c, h.clt_nonce, h.xid, proc));
+			break;
 		}
 
-		// get the latest connection to the client
-		{
-			ScopedLock rwl(&conss_m_);
-			if (c->isdead() && c != conns_[h.clt_nonce])
-			{
-				c->decref();
-				c = conns_[h.clt_nonce];
-				c->incref();
-			}
-		}
+		rh.ret = f->fn(req, rep);
+		assert(rh.ret >= 0 ||
+			   rh.ret == rpc_const::unmarshal_args_failure);
 
-		c->send(b1, sz1);
-		if (h.clt_nonce == 0)
-		{
-			// reply is not added to at-most-once window, free it
-			free(b1);
-		}
+		send_reply(c, h.clt_nonce, h.xid, proc, rh.ret, rep);
 		break;
 	case INPROGRESS: // server is working on this request
 		break;
@@ -592,6 +1100,67 @@ void rpcs::dispatch(djob_t *j)
 	c->decref();
 }
 
+void rpcs::send_reply(connection *c, unsigned int clt_nonce, unsigned int xid,
+					  unsigned int proc, int ret, marshall &rep)
+{
+	char *b1;
+	int sz1;
+	reply_header rh(xid, ret);
+
+	rep.pack_reply_header(rh);
+	rep.take_buf(&b1, &sz1);
+
+	jsl_log(JSL_DBG_2,
+			"rpcs::send_reply: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
+			sz1, xid, proc, ret, clt_nonce);
+
+	if (clt_nonce > 0)
+	{
+		// only record replies for clients that require at-most-once logic
+		add_reply(clt_nonce, xid, b1, sz1);
+	}
+
+	// get the latest connection to the client
+	c->incref();
+	{
+		ScopedLock rwl(&conss_m_);
+		if (clt_nonce > 0 && c->isdead() && c != conns_[clt_nonce])
+		{
+			c->decref();
+			c = conns_[clt_nonce];
+			c->incref();
+		}
+	}
+
+	c->send(b1, sz1);
+	c->decref();
+	if (clt_nonce == 0)
+	{
+		// reply is not added to at-most-once window, free it
+		free(b1);
+	}
+}
+
+deferred_reply::deferred_reply(rpcs *srv, connection *c, unsigned int clt_nonce,
+							   unsigned int xid, unsigned int proc)
+	: srv_(srv), conn_(c), clt_nonce_(clt_nonce), xid_(xid), proc_(proc)
+{
+	conn_->incref();
+}
+
+void deferred_reply::reply(int ret)
+{
+	marshall rep;
+	send(ret, rep);
+}
+
+void deferred_reply::send(int ret, marshall &rep)
+{
+	srv_->send_reply(conn_, clt_nonce_, xid_, proc_, ret, rep);
+	conn_->decref();
+	delete this;
+}
+
 void rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
 					 char *b, int sz)
 {
@@ -634,6 +1203,13 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
 
 	ScopedLock rwl(&reply_window_m_);
 	// std::list<rpcs::reply_t> store = reply_window_[clt_nonce];
+	if (reply_window_[clt_nonce].empty())
+	{
+		// everything up to xid_rep is done with. the rest may still
+		// come, in any order: a client of a restarted server sends
+		// again whatever it got no reply to.
+		reply_window_[clt_nonce].push_back(reply_t(xid_rep + 1));
+	}
 	jsl_log(JSL_DBG_4, "[rpc][%d]clt_nonce.front().xid=%d, xid=%d, xid_rep=%d\n", clt_nonce, reply_window_[clt_nonce].front().xid, xid, xid_rep);
 	if (xid < reply_window_[clt_nonce].front().xid)
 		return rpcs::rpcstate_t::FORGOTTEN;
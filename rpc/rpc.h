@@ -4,13 +4,24 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <list>
+#include <atomic>
 #include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <functional>
+#include <future>
+#include <memory>
+#include <utility>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "thr_pool.h"
 #include "marshall.h"
 #include "connection.h"
+#include "fifo.h"
+#include "timer_wheel.h"
+#include "xid_window.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -27,6 +38,14 @@ class rpc_const {
 		static const int bind_failure = -6;
 };
 
+// the outcome of an rpcc::call1_async. ret is the handler's return
+// value or an rpc_const failure; rep holds the reply if ret >= 0.
+class rpc_callback {
+	public:
+		virtual ~rpc_callback() {}
+		virtual void done(int ret, unmarshall &rep) = 0;
+};
+
 // rpc client endpoint.
 // manages a xid space per destination socket
 // threaded: multiple threads can be sending RPCs,
@@ -34,9 +53,10 @@ class rpcc : public chanmgr {
 
 	private:
 
-		//manages per rpc info
+		//manages per rpc info. callers are pooled (see get_caller),
+		//so their mutex and condition variable are set up only once
 		struct caller {
-			caller(unsigned int xxid, unmarshall *un);
+			caller();
 			~caller();
 
 			unsigned int xid;
@@ -45,10 +65,40 @@ class rpcc : public chanmgr {
 			bool done;
 			pthread_mutex_t m;
 			pthread_cond_t c;
+			// asynchronous calls only: whom to tell, the connection
+			// the request went out on and whether it died, the request
+			// itself for sending it again, when to give up (ms), and
+			// how long to wait before looking at the connection again
+			rpc_callback *cb;
+			connection *ch;
+			bool lost;
+			std::string req;
+			unsigned long long deadline;
+			int rto;
+			// when the request first went out (us), and whether it
+			// went out again: the reply of a resent request may answer
+			// either copy, so it says nothing about the round trip.
+			// nor does the reply of an untimed proc.
+			unsigned long long sent;
+			bool resent;
+			bool timed;
 		};
 
+		caller *get_caller(unsigned int xid, unmarshall *un);
+		void put_caller(caller *ca);
+		caller *find_call(unsigned int xid);
+		void add_call(caller *ca);
+		void erase_call(unsigned int xid);
+		void resize_calls(unsigned int size);
+
 		void get_refconn(connection **ch);
-		void update_xid_rep(unsigned int xid);
+		void finish_async(unsigned int xid, int ret);
+		void check_async(std::vector<unsigned int> &due);
+		void mark_lost(const std::vector<unsigned int> &xids);
+		void conn_lost(connection *c, std::vector<unsigned int> &failed);
+		void done_loop();
+		int rto_locked();
+		void rtt_sample(caller *ca);
 
 
 		sockaddr_in dst_;
@@ -58,14 +108,49 @@ class rpcc : public chanmgr {
 		unsigned int xid_;
 		int lossytest_;
 		bool retrans_;
+		// smoothed round trip time and its mean deviation (us); srtt_
+		// is 0 until the first reply
+		long long srtt_;
+		long long rttvar_;
+		// procs left out of srtt_ (see untimed)
+		std::set<unsigned int> untimed_;
 
 		connection *chan_;
 
 		pthread_mutex_t m_; // protect insert/delete to calls[]
 		pthread_mutex_t chan_m_;
 
-		std::map<int, caller *> calls_;
-		std::list<unsigned int> xid_rep_window_;
+		// outstanding calls, by open addressing: a call goes in the
+		// first free slot from calls_[xid & (calls_.size() - 1)] on.
+		// the table doubles when more than half full and halves when
+		// less than an eighth full, so a long-outstanding call costs
+		// one slot, and a scan of the table is linear in the calls.
+		std::vector<caller *> calls_;
+		unsigned int ncalls_;
+		// finished callers, for reuse
+		std::vector<caller *> free_callers_;
+		// the calls that got their reply (or gave up); everything up
+		// to xid_rep_.upto() tells the server what it can forget
+		xid_window xid_rep_;
+
+		// the completion thread, started by the first call1_async, runs
+		// the callbacks of finished asynchronous calls and is the one
+		// timer for all of them: async_timers_ says when to look at a
+		// call again (xids, in async_tick_ms ticks), to send it again
+		// on a new connection or to give up on it. no thread waits on
+		// a single call. all of this is under m_.
+		std::list<caller *> done_;
+		timer_wheel<unsigned int> async_timers_;
+		pthread_cond_t async_c_;
+		std::atomic<bool> done_th_started_;
+		bool stopping_;
+		pthread_t done_th_;
+		// connections that died, with a reference each, for the
+		// completion thread to look at (see lost_conn). lost_m_ is
+		// taken with a connection's mutex held, so nothing else may
+		// be locked under it.
+		pthread_mutex_t lost_m_;
+		std::vector<connection *> lost_conns_;
 
 	public:
 
@@ -80,13 +165,38 @@ class rpcc : public chanmgr {
 		static TO to(int x) { TO t; t.to = x; return t;}
 
 		unsigned int id() { return clt_nonce_; }
+		// how long a call waits (ms) before it first looks for a dead
+		// connection to send it again on
+		int rto();
+		// slots in the table of outstanding calls
+		unsigned int call_slots();
+		// replies to proc may be held back by the server (its handler
+		// is deferred and waits for something), so they say nothing
+		// about the round trip and are left out of the timeout
+		void untimed(unsigned int proc);
 
 		int bind(TO to = to_max);
 
 		int call1(unsigned int proc, 
 				marshall &req, unmarshall &rep, TO to);
+		void call1_async(unsigned int proc, marshall &req,
+				rpc_callback *cb, TO to = to_max);
+
+		// typed asynchronous calls: marshall the arguments like call(),
+		// return at once, and hand the handler's return value (or an
+		// rpc_const failure) and the unmarshalled reply to cb, on the
+		// completion thread; or to the returned future. R must be
+		// named: cl->call_async<int>(proc, cb, rpcc::to_max, a1, a2).
+		template<class R, class... Args>
+			void call_async(unsigned int proc,
+					std::function<void(int, R &)> cb, TO to,
+					const Args &... args);
+		template<class R, class... Args>
+			std::future<std::pair<int, R> > call_async(unsigned int proc,
+					TO to, const Args &... args);
 
 		bool got_pdu(connection *c, char *b, int sz);
+		void lost_conn(connection *c);
 
 
 		template<class R>
@@ -121,6 +231,57 @@ class rpcc : public chanmgr {
 
 };
 
+// unmarshalls the reply of a call_async for its callback
+template<class R>
+class rpc_typed_callback : public rpc_callback {
+	public:
+		rpc_typed_callback(std::function<void(int, R &)> cb) : cb_(cb) {}
+		void done(int ret, unmarshall &rep) {
+			R r = R();
+			if (ret >= 0) {
+				rep >> r;
+				if (rep.okdone() != true)
+					ret = rpc_const::unmarshal_reply_failure;
+			}
+			cb_(ret, r);
+			delete this;
+		}
+	private:
+		std::function<void(int, R &)> cb_;
+};
+
+inline void
+marshall_args(marshall &)
+{
+}
+
+template<class A1, class... Args> void
+marshall_args(marshall &m, const A1 &a1, const Args &... args)
+{
+	m << a1;
+	marshall_args(m, args...);
+}
+
+template<class R, class... Args> void
+rpcc::call_async(unsigned int proc, std::function<void(int, R &)> cb,
+		TO to, const Args &... args)
+{
+	marshall m;
+	marshall_args(m, args...);
+	call1_async(proc, m, new rpc_typed_callback<R>(cb), to);
+}
+
+template<class R, class... Args> std::future<std::pair<int, R> >
+rpcc::call_async(unsigned int proc, TO to, const Args &... args)
+{
+	std::shared_ptr<std::promise<std::pair<int, R> > > p(
+			new std::promise<std::pair<int, R> >());
+	call_async<R>(proc, [p](int ret, R &r) {
+			p->set_value(std::make_pair(ret, r));
+			}, to, args...);
+	return p->get_future();
+}
+
 template<class R> int 
 rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to) 
 {
@@ -230,6 +391,42 @@ rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
 
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
 
+class rpcs;
+
+// hears about the clients of an rpcs coming and going. called with an
+// rpcs mutex held, so it must not block or call back into the rpcs.
+class rpcs_watcher {
+	public:
+		virtual ~rpcs_watcher() {}
+		// the latest connection from the client died
+		virtual void client_lost(unsigned int clt_nonce) = 0;
+		// a client whose connection died sent a request on a new one
+		virtual void client_back(unsigned int clt_nonce) = 0;
+};
+
+// an RPC whose handler answers it after returning, e.g. once a lock
+// the caller waits for is released. the handler owns the object and
+// must call reply() exactly once, which sends the reply and frees it.
+class deferred_reply {
+	public:
+		template<class R> void reply(int ret, const R & r);
+		void reply(int ret);
+		unsigned int clt_nonce() { return clt_nonce_; }
+		unsigned int xid() { return xid_; }
+
+	private:
+		friend class rpcs;
+		deferred_reply(rpcs *srv, connection *c, unsigned int clt_nonce,
+				unsigned int xid, unsigned int proc);
+		void send(int ret, marshall &rep);
+
+		rpcs *srv_;
+		connection *conn_;
+		unsigned int clt_nonce_;
+		unsigned int xid_;
+		unsigned int proc_;
+};
+
 class handler {
 	public:
 		handler() { }
@@ -237,6 +434,14 @@ class handler {
 		virtual int fn(unmarshall &, marshall &) = 0;
 };
 
+// handler for a method that takes a deferred_reply * in place of
+// the reply reference; dispatch hands it the request and moves on.
+class deferred_handler : public handler {
+	public:
+		int fn(unmarshall &, marshall &) { assert(0); return 0; }
+		virtual void dfn(unmarshall &args, deferred_reply *d) = 0;
+};
+
 
 // rpc server endpoint.
 class rpcs : public chanmgr {
@@ -279,8 +484,21 @@ class rpcs : public chanmgr {
 
 	void updatestat(unsigned int proc);
 
+	// pack, remember (for at-most-once) and send a reply on the
+	// latest connection to the client
+	void send_reply(connection *c, unsigned int clt_nonce, unsigned int xid,
+			unsigned int proc, int ret, marshall &rep);
+	friend class deferred_reply;
+
 	// latest connection to the client
 	std::map<unsigned int, connection *> conns_;
+	rpcs_watcher *watcher_;
+	// connections lost since a dispatch thread last looked, and
+	// whether there are any (see lost_conn)
+	pthread_mutex_t lost_m_;
+	std::vector<connection *> lost_conns_;
+	std::atomic<bool> lost_pending_;
+	void conns_gone(bool);
 
 	// counting
 	const int counting_;
@@ -315,13 +533,23 @@ class rpcs : public chanmgr {
 	tcpsconn* listener_;
 
 	public:
-	rpcs(unsigned int port, int counts=0);
+	// port 0 picks any free port; port() says which. nonce 0 picks a
+	// new nonce; a restarted server that passes its old one is not
+	// taken for a different server by its clients.
+	rpcs(unsigned int port, int counts=0, unsigned int nonce=0);
 	~rpcs();
+	unsigned int port() { return port_; }
+	unsigned int nonce() { return nonce_; }
 
 	//RPC handler for clients binding
 	int rpcbind(int a, int &r);
 
 	bool got_pdu(connection *c, char *b, int sz);
+	void lost_conn(connection *c);
+
+	// w hears about clients that lose their connection, and about
+	// their return
+	void set_watcher(rpcs_watcher *w);
 
 	// register a handler
 	template<class S, class A1, class R>
@@ -350,8 +578,33 @@ class rpcs : public chanmgr {
 						const A3, const A4, const A5, 
 						const A6, const A7,
 						R & r));
+
+	// register a handler that replies later through a deferred_reply.
+	// the rpcs must outlive every deferred_reply it hands out. T is
+	// void, or rpc_task for a coroutine (see rpc_coro.h); what the
+	// handler returns is dropped.
+	template<class S, class T, class A1>
+		void reg(unsigned int proc, S*, T (S::*meth)(const A1, 
+					deferred_reply *d));
+	template<class S, class T, class A1, class A2>
+		void reg(unsigned int proc, S*, T (S::*meth)(const A1, const A2, 
+					deferred_reply *d));
+	template<class S, class T, class A1, class A2, class A3>
+		void reg(unsigned int proc, S*, T (S::*meth)(const A1, const A2, 
+					const A3, deferred_reply *d));
+	template<class S, class T, class A1, class A2, class A3, class A4>
+		void reg(unsigned int proc, S*, T (S::*meth)(const A1, const A2, 
+					const A3, const A4, deferred_reply *d));
 };
 
+template<class R> void
+deferred_reply::reply(int ret, const R & r)
+{
+	marshall rep;
+	rep << r;
+	send(ret, rep);
+}
+
 template<class S, class A1, class R> void
 rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
 {
@@ -583,6 +836,119 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 	reg1(proc, new h1(sob, meth));
 }
 
+template<class S, class T, class A1> void
+rpcs::reg(unsigned int proc, S*sob, T (S::*meth)(const A1 a1, 
+			deferred_reply *d))
+{
+	class h1 : public deferred_handler {
+		private:
+			S * sob;
+			T (S::*meth)(const A1 a1, deferred_reply *d);
+		public:
+			h1(S *xsob, T (S::*xmeth)(const A1 a1, deferred_reply *d))
+				: sob(xsob), meth(xmeth) { }
+			void dfn(unmarshall &args, deferred_reply *d) {
+				A1 a1;
+				args >> a1;
+				if(!args.okdone()) {
+					d->reply(rpc_const::unmarshal_args_failure);
+					return;
+				}
+				(sob->*meth)(a1, d);
+			}
+	};
+	reg1(proc, new h1(sob, meth));
+}
+
+template<class S, class T, class A1, class A2> void
+rpcs::reg(unsigned int proc, S*sob, T (S::*meth)(const A1 a1, const A2 a2, 
+			deferred_reply *d))
+{
+	class h1 : public deferred_handler {
+		private:
+			S * sob;
+			T (S::*meth)(const A1 a1, const A2 a2, deferred_reply *d);
+		public:
+			h1(S *xsob, T (S::*xmeth)(const A1 a1, const A2 a2, 
+						deferred_reply *d))
+				: sob(xsob), meth(xmeth) { }
+			void dfn(unmarshall &args, deferred_reply *d) {
+				A1 a1;
+				A2 a2;
+				args >> a1;
+				args >> a2;
+				if(!args.okdone()) {
+					d->reply(rpc_const::unmarshal_args_failure);
+					return;
+				}
+				(sob->*meth)(a1, a2, d);
+			}
+	};
+	reg1(proc, new h1(sob, meth));
+}
+
+template<class S, class T, class A1, class A2, class A3> void
+rpcs::reg(unsigned int proc, S*sob, T (S::*meth)(const A1 a1, const A2 a2, 
+			const A3 a3, deferred_reply *d))
+{
+	class h1 : public deferred_handler {
+		private:
+			S * sob;
+			T (S::*meth)(const A1 a1, const A2 a2, const A3 a3, 
+					deferred_reply *d);
+		public:
+			h1(S *xsob, T (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
+						deferred_reply *d))
+				: sob(xsob), meth(xmeth) { }
+			void dfn(unmarshall &args, deferred_reply *d) {
+				A1 a1;
+				A2 a2;
+				A3 a3;
+				args >> a1;
+				args >> a2;
+				args >> a3;
+				if(!args.okdone()) {
+					d->reply(rpc_const::unmarshal_args_failure);
+					return;
+				}
+				(sob->*meth)(a1, a2, a3, d);
+			}
+	};
+	reg1(proc, new h1(sob, meth));
+}
+
+template<class S, class T, class A1, class A2, class A3, class A4> void
+rpcs::reg(unsigned int proc, S*sob, T (S::*meth)(const A1 a1, const A2 a2, 
+			const A3 a3, const A4 a4, deferred_reply *d))
+{
+	class h1 : public deferred_handler {
+		private:
+			S * sob;
+			T (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
+					deferred_reply *d);
+		public:
+			h1(S *xsob, T (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
+						const A4 a4, deferred_reply *d))
+				: sob(xsob), meth(xmeth) { }
+			void dfn(unmarshall &args, deferred_reply *d) {
+				A1 a1;
+				A2 a2;
+				A3 a3;
+				A4 a4;
+				args >> a1;
+				args >> a2;
+				args >> a3;
+				args >> a4;
+				if(!args.okdone()) {
+					d->reply(rpc_const::unmarshal_args_failure);
+					return;
+				}
+				(sob->*meth)(a1, a2, a3, a4, d);
+			}
+	};
+	reg1(proc, new h1(sob, meth));
+}
+
 
 void make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
 void make_sockaddr(const char *host, const char *port,
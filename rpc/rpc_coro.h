@@ -0,0 +1,93 @@
+#ifndef rpc_coro_h
+#define rpc_coro_h
+
+// C++20 coroutines over the asynchronous rpc calls.
+//
+// a coroutine that returns rpc_task can co_await rpc_call<R>(cl, proc,
+// to, args...) and gets back the std::pair<int, R> a synchronous call()
+// would have produced: the handler's return value (or an rpc_const
+// failure) and the reply. no thread waits while the call is out; the
+// coroutine resumes on cl's completion thread (see rpcc::call1_async),
+// so like any call_async callback it must not block there for long.
+//
+// rpcs::reg takes a deferred handler that returns rpc_task, so a
+// handler can make nested calls without holding a dispatch thread:
+//
+//	rpc_task srv::handle(const int a, deferred_reply *d) {
+//		std::pair<int, int> r = co_await rpc_call<int>(cl, proc,
+//			rpcc::to_max, a);
+//		d->reply(r.first, r.second);
+//	}
+//
+// the dispatch thread is free again at the first co_await, and the
+// handler must reply through d exactly once, as it would otherwise.
+
+#ifdef __cpp_impl_coroutine
+
+#include <assert.h>
+#include <stdio.h>
+#include <coroutine>
+#include <functional>
+#include <tuple>
+#include <utility>
+#include "rpc.h"
+
+// an eager coroutine that nobody waits for: it runs up to its first
+// co_await when called, and its frame goes away when it finishes.
+class rpc_task {
+	public:
+		struct promise_type {
+			rpc_task get_return_object() { return rpc_task(); }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() { }
+			void unhandled_exception() {
+				fprintf(stderr, "rpc_task: uncaught exception\n");
+				assert(0);
+			}
+		};
+};
+
+template<class R, class... Args>
+class rpc_awaitable {
+	public:
+		rpc_awaitable(rpcc *cl, unsigned int proc, rpcc::TO to,
+				const Args &... args)
+			: cl_(cl), proc_(proc), to_(to), args_(args...), ret_(0), r_() { }
+
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h) {
+			marshall m;
+			std::apply([&m](const Args &... a) { marshall_args(m, a...); },
+					args_);
+			// the callback may run, and resume h, before call1_async
+			// returns; this lives in h's frame, so don't touch it after
+			cl_->call1_async(proc_, m, new rpc_typed_callback<R>(
+						[this, h](int ret, R &r) {
+							ret_ = ret;
+							r_ = r;
+							h.resume();
+						}), to_);
+		}
+		std::pair<int, R> await_resume() {
+			return std::make_pair(ret_, r_);
+		}
+
+	private:
+		rpcc *cl_;
+		unsigned int proc_;
+		rpcc::TO to_;
+		std::tuple<Args...> args_;
+		int ret_;
+		R r_;
+};
+
+template<class R, class... Args> rpc_awaitable<R, Args...>
+rpc_call(rpcc *cl, unsigned int proc, rpcc::TO to, const Args &... args)
+{
+	return rpc_awaitable<R, Args...>(cl, proc, to, args...);
+}
+
+#endif
+
+#endif
@@ -12,8 +12,13 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <set>
 
 #include "rpc.h"
+#include "rpc_coro.h"
+#include "xid_window.h"
+#include "slock.h"
 
 #include "jsl_log.h"
 #include "gettime.h"
@@ -40,6 +45,15 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_sleep(const int ms, int &r);
+		void handle_park(const int a, deferred_reply *d);
+		int handle_unpark(const int a, int &r);
+#ifdef __cpp_impl_coroutine
+		rpc_task handle_nested(const int a, deferred_reply *d);
+#endif
+
+		pthread_mutex_t parked_m;
+		std::list<std::pair<int, deferred_reply *> > parked;
 };
 
 
@@ -116,6 +130,14 @@ srv::handle_slow(const int a, int &r)
 	return 0;
 }
 
+int
+srv::handle_sleep(const int ms, int &r)
+{
+	usleep(ms * 1000);
+	r = ms;
+	return 0;
+}
+
 int
 srv::handle_bigrep(const int len, std::string &r)
 {
@@ -123,15 +145,87 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+// replies later: parks the request until handle_unpark() runs
+void
+srv::handle_park(const int a, deferred_reply *d)
+{
+	ScopedLock pl(&parked_m);
+	parked.push_back(std::make_pair(a, d));
+}
+
+int
+srv::handle_unpark(const int a, int &r)
+{
+	std::list<std::pair<int, deferred_reply *> > l;
+	{
+		ScopedLock pl(&parked_m);
+		l.swap(parked);
+	}
+	r = l.size();
+	for (; !l.empty(); l.pop_front())
+		l.front().second->reply(0, l.front().first + a);
+	return 0;
+}
+
+#ifdef __cpp_impl_coroutine
+// calls back into the server and answers with one more than it got.
+// the nested call parks, so this only finishes after handle_unpark().
+rpc_task
+srv::handle_nested(const int a, deferred_reply *d)
+{
+	std::pair<int, int> r = co_await rpc_call<int>(clients[1], 26,
+			rpcc::to_max, a);
+	assert(r.first == 0);
+	d->reply(0, r.second + 1);
+}
+#endif
+
 srv service;
 
 void startserver()
 {
+	assert(pthread_mutex_init(&service.parked_m, 0) == 0);
 	server = new rpcs(port);
 	server->reg(22, &service, &srv::handle_22);
 	server->reg(23, &service, &srv::handle_fast);
 	server->reg(24, &service, &srv::handle_slow);
 	server->reg(25, &service, &srv::handle_bigrep);
+	server->reg(26, &service, &srv::handle_park);
+	server->reg(27, &service, &srv::handle_unpark);
+#ifdef __cpp_impl_coroutine
+	server->reg(28, &service, &srv::handle_nested);
+#endif
+	server->reg(29, &service, &srv::handle_sleep);
+}
+
+// xids finish in random order, at most some way past the first one
+// still out; xid_window must agree with a plain set of the done ones
+void
+test_xid_window()
+{
+	for (int round = 0; round < 10; round++) {
+		xid_window w;
+		std::vector<unsigned int> out; // started, not done
+		std::set<unsigned int> done; // past upto
+		unsigned int next = 1, upto = 0;
+		unsigned int spread = 1 + random() % 5000;
+		while (next < 100000) {
+			while (out.size() < spread)
+				out.push_back(next++);
+			unsigned int i = random() % out.size();
+			unsigned int x = out[i];
+			out[i] = out.back();
+			out.pop_back();
+			w.done(x);
+			done.insert(x);
+			while (done.count(upto + 1))
+				done.erase(++upto);
+			if (random() % 100 == 0)
+				w.done(upto); // again: ignored
+			assert(w.upto() == upto);
+		}
+	}
+	printf("xid_window OK\n");
 }
 
 void
@@ -370,6 +464,160 @@ concurrent_test(int nt)
 	printf(" OK\n");
 }
 
+void *
+client5(void *xx)
+{
+	// park a call on the server, which answers it from handle_unpark()
+	long int which = (long int) xx;
+	int rep;
+	int ret = clients[0]->call(26, (int)which, rep);
+	assert(ret == 0 && rep == which + 100);
+	return 0;
+}
+
+void
+deferred_test(int nt)
+{
+	// park more calls than the server has dispatch threads; they must
+	// not hold on to them, or the unpark call could never run.
+	int ret, n = 0;
+
+	printf("start deferred_test (%d threads) ...", nt);
+
+	pthread_t th[nt];
+	for(long int i = 0; i < nt; i++){
+		ret = pthread_create(&th[i], &attr, client5, (void *) i);
+		assert(ret == 0);
+	}
+
+	while (n < nt) {
+		int r;
+		usleep(100000);
+		assert(clients[1]->call(27, 100, r) == 0);
+		n += r;
+	}
+
+	for(int i = 0; i < nt; i++){
+		assert(pthread_join(th[i], NULL) == 0);
+	}
+	printf(" OK\n");
+}
+
+// counts replies to parked calls, checking each one
+struct park_done : public rpc_callback {
+	park_done(int xmax) : n(0), max(xmax) {
+		assert(pthread_mutex_init(&m, 0) == 0);
+		assert(pthread_cond_init(&c, 0) == 0);
+	}
+	void done(int ret, unmarshall &rep) {
+		int r;
+		assert(ret == 0);
+		rep >> r;
+		assert(rep.okdone() && r >= 100 && r < 100 + max);
+		ScopedLock ml(&m);
+		n++;
+		assert(pthread_cond_signal(&c) == 0);
+	}
+	int n, max;
+	pthread_mutex_t m;
+	pthread_cond_t c;
+};
+
+void
+async_test(int n)
+{
+	// one thread keeps n calls outstanding at once
+	park_done pd(n);
+
+	printf("start async_test (%d calls) ...", n);
+	for (int i = 0; i < n; i++) {
+		marshall m;
+		m << i;
+		clients[0]->call1_async(26, m, &pd);
+	}
+	int parked = 0;
+	while (parked < n) {
+		int r;
+		usleep(100000);
+		assert(clients[1]->call(27, 100, r) == 0);
+		parked += r;
+	}
+	ScopedLock ml(&pd.m);
+	while (pd.n < n)
+		assert(pthread_cond_wait(&pd.c, &pd.m) == 0);
+	printf(" OK\n");
+}
+
+// typed asynchronous calls from one thread, with callbacks and futures.
+// they must all succeed, even on a lossy network.
+void
+typed_async_test(int n, bool lossy)
+{
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	int ok = 0;
+	assert(pthread_mutex_init(&m, 0) == 0);
+	assert(pthread_cond_init(&c, 0) == 0);
+
+	printf("start typed_async_test (%d calls%s) ...", n, lossy ? ", lossy" : "");
+	for (int i = 0; i < n; i++) {
+		clients[0]->call_async<int>(23, [&, i](int ret, int &r) {
+				assert(ret == 0 && r == i + 1);
+				ScopedLock ml(&m);
+				ok++;
+				assert(pthread_cond_signal(&c) == 0);
+				}, rpcc::to_max, i);
+	}
+	std::future<std::pair<int, std::string> > f =
+		clients[0]->call_async<std::string>(22, rpcc::to_max,
+				std::string("hello"), std::string(" goodbye"));
+	{
+		ScopedLock ml(&m);
+		while (ok < n)
+			assert(pthread_cond_wait(&c, &m) == 0);
+	}
+	std::pair<int, std::string> s = f.get();
+	assert(s.first == 0 && s.second == "hello goodbye");
+
+	if (!lossy) {
+		// a call nobody answers in time fails on its own
+		std::future<std::pair<int, int> > p =
+			clients[0]->call_async<int>(26, rpcc::to(1500), 0);
+		assert(p.get().first == rpc_const::timeout_failure);
+		int r;
+		assert(clients[1]->call(27, 100, r) == 0 && r == 1);
+	}
+	assert(pthread_mutex_destroy(&m) == 0);
+	assert(pthread_cond_destroy(&c) == 0);
+	printf(" OK\n");
+}
+
+#ifdef __cpp_impl_coroutine
+void
+coroutine_test(int n)
+{
+	// more handlers than dispatch threads wait on nested calls at once;
+	// suspended, they must not hold on to the threads.
+	std::vector<std::future<std::pair<int, int> > > f;
+
+	printf("start coroutine_test (%d calls) ...", n);
+	for (int i = 0; i < n; i++)
+		f.push_back(clients[0]->call_async<int>(28, rpcc::to_max, i));
+	int parked = 0;
+	while (parked < n) {
+		int r;
+		usleep(100000);
+		assert(clients[1]->call(27, 100, r) == 0);
+		parked += r;
+	}
+	for (int i = 0; i < n; i++) {
+		std::pair<int, int> r = f[i].get();
+		assert(r.first == 0 && r.second == i + 101);
+	}
+	printf(" OK\n");
+}
+#endif
+
 void 
 garbage_collection_test(int nt)
 {
@@ -390,6 +638,107 @@ garbage_collection_test(int nt)
 }
 
 
+void
+calls_test(int n)
+{
+	// a call that stays outstanding does not make the table of
+	// outstanding calls grow with the calls made meanwhile, and the
+	// table shrinks back after a burst of calls
+	rpcc *c = clients[0];
+	int r;
+
+	printf("start calls_test (%d calls) ...", n);
+	std::future<std::pair<int, int> > p =
+		c->call_async<int>(26, rpcc::to_max, 0);
+	for (int i = 0; i < n; i++)
+		assert(c->call(23, i, r) == 0 && r == i + 1);
+	assert(c->call_slots() == 64);
+	std::vector<std::future<std::pair<int, int> > > f;
+	for (int i = 0; i < n; i++)
+		f.push_back(c->call_async<int>(23, rpcc::to_max, i));
+	for (int i = 0; i < n; i++) {
+		std::pair<int, int> x = f[i].get();
+		assert(x.first == 0 && x.second == i + 1);
+	}
+	assert(c->call_slots() == 64);
+	assert(clients[1]->call(27, 1, r) == 0 && r == 1);
+	assert(p.get().first == 0);
+	printf(" OK\n");
+}
+
+void
+rto_test(int n, bool lossy)
+{
+	// a few replies bring the retransmission timeout down from to_min,
+	// so a call whose connection dies is sent again well within it
+	rpcc *c = clients[0];
+	int r, worst = 0;
+
+	printf("start rto_test (%d calls%s) ...", n, lossy ? ", lossy" : "");
+	for (int i = 0; i < 20; i++)
+		assert(c->call(23, i, r) == 0 && r == i + 1);
+	assert(c->rto() < rpcc::to_min.to);
+	for (int i = 0; i < n; i++) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_REALTIME, &start);
+		assert(c->call(23, i, r) == 0 && r == i + 1);
+		clock_gettime(CLOCK_REALTIME, &end);
+		worst = std::max(worst, diff_timespec(end, start));
+	}
+	assert(worst < rpcc::to_min.to);
+	printf(" rto %d ms, slowest call %d ms ... OK\n", c->rto(), worst);
+}
+
+void
+deferred_rto_test(int n)
+{
+	// replies that a handler held back for longer than the timeout
+	// say nothing about the network, and leave the timeout of a
+	// client that marks the proc untimed alone
+	rpcc *c = clients[0];
+	int r;
+
+	printf("start deferred_rto_test (%d calls) ...", n);
+	c->untimed(26);
+	for (int i = 0; i < 20; i++)
+		assert(c->call(23, i, r) == 0 && r == i + 1);
+	int before = c->rto();
+	for (int i = 0; i < n; i++) {
+		std::future<std::pair<int, int> > p =
+			c->call_async<int>(26, rpcc::to_max, i);
+		usleep((before + 100) * 1000);
+		assert(clients[1]->call(27, 1, r) == 0 && r == 1);
+		std::pair<int, int> x = p.get();
+		assert(x.first == 0 && x.second == i + 1);
+	}
+	assert(c->rto() < before + 100);
+	printf(" rto %d ms, then %d ms ... OK\n", before, c->rto());
+}
+
+void
+rto_rise_test(int n)
+{
+	// once replies take longer than the timeout, it goes up with them,
+	// and comes back down once they are fast again
+	rpcc *c = clients[1];
+	int r;
+
+	printf("start rto_rise_test (%d calls) ...", n);
+	for (int i = 0; i < 20; i++)
+		assert(c->call(23, i, r) == 0 && r == i + 1);
+	int before = c->rto();
+	int slow = before + 50;
+	for (int i = 0; i < n; i++)
+		assert(c->call(29, slow, r) == 0 && r == slow);
+	int raised = c->rto();
+	assert(raised >= slow);
+	for (int i = 0; i < 100; i++)
+		assert(c->call(23, i, r) == 0 && r == i + 1);
+	assert(c->rto() < raised);
+	printf(" rto %d ms, then %d ms, then %d ms ... OK\n", before, raised,
+			c->rto());
+}
+
 void 
 lossy_test()
 {
@@ -419,6 +768,9 @@ lossy_test()
 		assert(pthread_join(th[i], NULL) == 0);
 	}
 	printf(" OK\n");
+	rto_test(200, true);
+	// lost connections make asynchronous calls go out again
+	typed_async_test(200, true);
 	assert(setenv("RPC_LOSSY", "0", 1) == 0);
 }
 
@@ -541,6 +893,7 @@ main(int argc, char *argv[])
 	}
 
 	testmarshall();
+	test_xid_window();
 
 	pthread_attr_init(&attr);
 	// set stack size to 32K, so we don't run out of memory
@@ -570,8 +923,18 @@ main(int argc, char *argv[])
 
 		simple_tests(clients[0]);
 		concurrent_test(10);
+		rto_test(200, false);
+		async_test(300);
+		typed_async_test(1000, false);
 		lossy_test();
 		if (isserver) {
+			deferred_test(30);
+			calls_test(2000);
+			deferred_rto_test(10);
+			rto_rise_test(20);
+#ifdef __cpp_impl_coroutine
+			coroutine_test(30);
+#endif
 			failure_test();
             garbage_collection_test(1);
 		}
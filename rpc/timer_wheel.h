@@ -0,0 +1,122 @@
+#ifndef timer_wheel_h
+#define timer_wheel_h
+
+// hierarchical timer wheel
+// schedules items at a tick in O(1) and hands back the ones that are
+// due as the wheel advances, at O(1) amortized cost per item no matter
+// how many are pending. ticks are whatever unit the caller counts in.
+// there is no cancel: callers check whether a returned item still
+// matters and simply ignore it (or add it again) if not.
+// not thread safe; callers serialize add() and advance().
+
+#include <assert.h>
+#include <vector>
+
+template<class T>
+class timer_wheel {
+	public:
+		timer_wheel(unsigned long long now=0);
+
+		// schedule t to come due at tick expires (or at the next tick,
+		// if that has already passed)
+		void add(const T &t, unsigned long long expires);
+		// process every tick up to and including now, appending the
+		// items that came due to expired
+		void advance(unsigned long long now, std::vector<T> &expired);
+		unsigned int size() { return n_; }
+
+	private:
+		enum {
+			ROOT_BITS = 8,
+			LEVEL_BITS = 6,
+			LEVELS = 4, // root plus three coarser levels, 2^26 ticks in all
+			ROOT_SIZE = 1 << ROOT_BITS,
+			LEVEL_SIZE = 1 << LEVEL_BITS,
+		};
+		struct entry {
+			entry(const T &xt, unsigned long long xe) : t(xt), expires(xe) {}
+			T t;
+			unsigned long long expires;
+		};
+		typedef std::vector<entry> slot;
+
+		void place(const entry &e);
+		unsigned int cascade(int level);
+		static unsigned int shift(int level) {
+			return level ? ROOT_BITS + (level - 1) * LEVEL_BITS : 0;
+		}
+
+		slot root_[ROOT_SIZE];
+		slot levels_[LEVELS - 1][LEVEL_SIZE];
+		unsigned long long now_; // next tick to process
+		unsigned int n_;
+};
+
+template<class T>
+timer_wheel<T>::timer_wheel(unsigned long long now) : now_(now), n_(0)
+{
+}
+
+template<class T> void
+timer_wheel<T>::place(const entry &e)
+{
+	unsigned long long expires = e.expires < now_ ? now_ : e.expires;
+	unsigned long long delta = expires - now_;
+
+	if (delta < ROOT_SIZE) {
+		root_[expires & (ROOT_SIZE - 1)].push_back(e);
+		return;
+	}
+	for (int l = 1; l < LEVELS; l++) {
+		if (delta < (1ULL << shift(l + 1)) || l == LEVELS - 1) {
+			// too far out for the last level: park it in the furthest
+			// slot, it is placed again when that slot cascades
+			if (delta >= (1ULL << shift(l + 1)))
+				expires = now_ + (1ULL << shift(l + 1)) - 1;
+			levels_[l - 1][(expires >> shift(l)) & (LEVEL_SIZE - 1)].push_back(e);
+			return;
+		}
+	}
+}
+
+template<class T> void
+timer_wheel<T>::add(const T &t, unsigned long long expires)
+{
+	place(entry(t, expires));
+	n_++;
+}
+
+// moves the entries of the current slot at level down a level; they all
+// come due within the span of one slot of the level below
+template<class T> unsigned int
+timer_wheel<T>::cascade(int level)
+{
+	unsigned int idx = (now_ >> shift(level)) & (LEVEL_SIZE - 1);
+	slot s;
+	s.swap(levels_[level - 1][idx]);
+	for (unsigned i = 0; i < s.size(); i++)
+		place(s[i]);
+	return idx;
+}
+
+template<class T> void
+timer_wheel<T>::advance(unsigned long long now, std::vector<T> &expired)
+{
+	while (now_ <= now) {
+		unsigned int idx = now_ & (ROOT_SIZE - 1);
+		for (int l = 1; idx == 0 && l < LEVELS; l++)
+			idx = cascade(l);
+
+		// a root slot only ever holds items due at the tick it stands for
+		slot &s = root_[now_ & (ROOT_SIZE - 1)];
+		for (unsigned i = 0; i < s.size(); i++) {
+			assert(s[i].expires <= now_);
+			expired.push_back(s[i].t);
+		}
+		n_ -= s.size();
+		s.clear();
+		now_++;
+	}
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef xid_window_h
+#define xid_window_h
+
+// the xids of a client's calls that are done, in any order, as the
+// highest xid up to which all of them are done plus a ring of bits for
+// the later ones. bit x of the ring (x modulo its size) is set for a
+// done xid x past upto(); the ring doubles if x gets a full ring ahead.
+// xids start at 1. not thread safe.
+
+#include <vector>
+
+class xid_window {
+	public:
+		xid_window() : upto_(0), bits_(64, 0) { }
+
+		void done(unsigned int xid);
+		// every xid up to this one is done
+		unsigned int upto() const { return upto_; }
+
+	private:
+		void grow();
+
+		unsigned int upto_;
+		std::vector<unsigned long long> bits_;
+};
+
+inline void
+xid_window::done(unsigned int xid)
+{
+	if (xid <= upto_)
+		return;
+	while (xid - upto_ > bits_.size() * 64)
+		grow();
+
+	unsigned int mask = bits_.size() * 64 - 1;
+	unsigned int i = xid & mask;
+	bits_[i / 64] |= 1ULL << (i % 64);
+
+	// move upto_ past the run of done xids after it, a word at a time
+	while (1)
+	{
+		unsigned int p = (upto_ + 1) & mask;
+		unsigned long long &w = bits_[p / 64];
+		unsigned int o = p % 64;
+		unsigned long long notdone = ~(w >> o);
+		unsigned int n = notdone ? __builtin_ctzll(notdone) : 64;
+		if (n == 0)
+			break;
+		w &= ~((n == 64 ? ~0ULL : (1ULL << n) - 1) << o);
+		upto_ += n;
+		if (o + n < 64)
+			break;
+	}
+}
+
+inline void
+xid_window::grow()
+{
+	unsigned int nbits = bits_.size() * 64;
+	std::vector<unsigned long long> bigger(bits_.size() * 2, 0);
+	for (unsigned int x = upto_ + 1; x - upto_ <= nbits; x++)
+	{
+		unsigned int i = x & (nbits - 1);
+		if (bits_[i / 64] & (1ULL << (i % 64)))
+		{
+			unsigned int j = x & (nbits * 2 - 1);
+			bigger[j / 64] |= 1ULL << (j % 64);
+		}
+	}
+	bits_.swap(bigger);
+}
+
+#endif